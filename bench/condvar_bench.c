@@ -0,0 +1,314 @@
+/*
+ * Producer/consumer queue over one sched_lock or fairlock: lock_cond waits
+ * next to the release-and-retry loop they replace.
+ *
+ * Producers and consumers move items through a bounded ring guarded by the
+ * lock, doing -w/-W us of work outside the lock per item. A fiber that finds
+ * the ring full (producer) or empty (consumer) either waits on a lock_cond
+ * (-m cond) or lets go of the lock, sleeps -s us (yields if 0) and retries
+ * (-m poll). The report gives items per second and process CPU time per item,
+ * which is where polling shows: it keeps taking the lock, and with
+ * sched_lock whole slices, while there is nothing to do.
+ *
+ *   condvar_bench -l schedlock -m cond -p 1 -c 4 -w 20
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "fiber_manager.h"
+#include "fiber_io.h"
+#include "schedlock.h"
+#include "fairlock.h"
+#include "lockcond.h"
+#include "timing.h"
+
+#define COND_BENCH_MAX_FIBERS 256
+#define COND_BENCH_STACK      16384
+
+typedef unsigned long long ull;
+
+struct cond_bench {
+    int use_fairlock;
+    int poll;
+    uint64_t poll_sleep_us;
+    int producers;
+    int consumers;
+    uint64_t produce_ns;        // work per item outside the lock
+    uint64_t consume_ns;
+    uint64_t end_time;
+
+    struct sched_lock *slock;
+    struct fairlock *flock;
+    struct lock_cond not_empty;
+    struct lock_cond not_full;
+
+    /* Under the lock. */
+    uint64_t *ring;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    int producers_left;
+    uint64_t consumed;
+    uint64_t retries;           // poll mode: full or empty ring found, lock let go
+};
+
+struct cond_fiber {
+    struct cond_bench *bench;
+    int fid;
+};
+
+static void bench_lock(struct cond_bench *b, int fid)
+{
+    if (b->use_fairlock)
+        fair_lock(b->flock, fid);
+    else
+        sched_lock_acquire(b->slock);
+}
+
+static void bench_unlock(struct cond_bench *b)
+{
+    if (b->use_fairlock)
+        fair_unlock(b->flock);
+    else
+        sched_lock_release(b->slock);
+}
+
+/* Nothing to do under the lock yet: wait on cond, or let go and retry. Holds the lock again on return. */
+static void bench_wait(struct cond_bench *b, int fid, struct lock_cond *cond)
+{
+    if (!b->poll) {
+        if (b->use_fairlock)
+            fair_cond_wait(b->flock, fid, cond);
+        else
+            sched_lock_cond_wait(b->slock, cond);
+        return;
+    }
+    b->retries++;
+    bench_unlock(b);
+    if (b->poll_sleep_us > 0)
+        fiber_sleep(0, b->poll_sleep_us);
+    else
+        fiber_yield();
+    bench_lock(b, fid);
+}
+
+static void spin_for(uint64_t ns)
+{
+    uint64_t until = now_ns() + ns;
+
+    while (now_ns() < until) {
+    }
+}
+
+static void *producer(void *param)
+{
+    struct cond_fiber *f = param;
+    struct cond_bench *b = f->bench;
+    uint64_t item = 0;
+
+    while (now_ns() < b->end_time) {
+        spin_for(b->produce_ns);
+        bench_lock(b, f->fid);
+        while (b->count == b->capacity) {
+            bench_wait(b, f->fid, &b->not_full);
+        }
+        b->ring[(b->head + b->count) % b->capacity] = item++;
+        b->count++;
+        bench_unlock(b);
+        /* Outside the lock, so the woken consumer does not run into it. */
+        lock_cond_signal(&b->not_empty);
+    }
+
+    /* The last producer out lets idle consumers see the end. */
+    bench_lock(b, f->fid);
+    if (--b->producers_left == 0)
+        lock_cond_broadcast(&b->not_empty);
+    bench_unlock(b);
+    return NULL;
+}
+
+static void *consumer(void *param)
+{
+    struct cond_fiber *f = param;
+    struct cond_bench *b = f->bench;
+
+    for (;;) {
+        bench_lock(b, f->fid);
+        while (b->count == 0 && b->producers_left > 0) {
+            bench_wait(b, f->fid, &b->not_empty);
+        }
+        if (b->count == 0) {
+            bench_unlock(b);
+            return NULL;
+        }
+        b->head = (b->head + 1) % b->capacity;
+        b->count--;
+        b->consumed++;
+        bench_unlock(b);
+        lock_cond_signal(&b->not_full);
+        spin_for(b->consume_ns);
+    }
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n", prog);
+    printf("  -l LOCK   schedlock or fairlock (default schedlock)\n");
+    printf("  -m MODE   cond (lock_cond waits) or poll (release, sleep, retry) (default cond)\n");
+    printf("  -p N      producer fibers (default 1)\n");
+    printf("  -c N      consumer fibers (default 4)\n");
+    printf("  -q N      ring capacity (default 64)\n");
+    printf("  -w US     producer work per item outside the lock (default 20)\n");
+    printf("  -W US     consumer work per item outside the lock (default 0)\n");
+    printf("  -s US     poll mode: sleep before retrying, 0 yields (default 0)\n");
+    printf("  -k N      worker threads (default 2)\n");
+    printf("  -d S      duration in seconds (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct cond_bench b;
+    static struct cond_fiber fibers[COND_BENCH_MAX_FIBERS];
+    fiber_t *handles[COND_BENCH_MAX_FIBERS];
+    struct lock_cond_stats empty_stats, full_stats;
+    const char *lock_name = "schedlock";
+    uint64_t duration_s = 1, start;
+    double cpu, wall;
+    int opt, i, n, workers = 2;
+
+    b.producers = 1;
+    b.consumers = 4;
+    b.capacity = 64;
+    b.produce_ns = 20 * NSEC_PER_USEC;
+
+    while ((opt = getopt(argc, argv, "l:m:p:c:q:w:W:s:k:d:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            lock_name = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "cond") != 0 && strcmp(optarg, "poll") != 0) {
+                fprintf(stderr, "Error: Unknown mode '%s'\n", optarg);
+                return 1;
+            }
+            b.poll = strcmp(optarg, "poll") == 0;
+            break;
+        case 'p':
+            b.producers = atoi(optarg);
+            break;
+        case 'c':
+            b.consumers = atoi(optarg);
+            break;
+        case 'q':
+            b.capacity = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            b.produce_ns = strtoull(optarg, NULL, 10) * NSEC_PER_USEC;
+            break;
+        case 'W':
+            b.consume_ns = strtoull(optarg, NULL, 10) * NSEC_PER_USEC;
+            break;
+        case 's':
+            b.poll_sleep_us = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            workers = atoi(optarg);
+            break;
+        case 'd':
+            duration_s = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (strcmp(lock_name, "schedlock") != 0 && strcmp(lock_name, "fairlock") != 0) {
+        fprintf(stderr, "Error: Unknown lock '%s'\n", lock_name);
+        return 1;
+    }
+    n = b.producers + b.consumers;
+    if (b.producers < 1 || b.consumers < 1 || n > COND_BENCH_MAX_FIBERS ||
+        b.capacity == 0 || workers < 1 || duration_s == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    timing_calibrate();
+    fiber_manager_init(workers);
+
+    b.use_fairlock = strcmp(lock_name, "fairlock") == 0;
+    if (b.use_fairlock) {
+        b.flock = aligned_alloc(FAIRLOCK_CACHELINE, sizeof(*b.flock));
+        if (!b.flock) {
+            fprintf(stderr, "Error: Unable to allocate fairlock\n");
+            return 1;
+        }
+        fairlock_init(b.flock);
+    } else {
+        b.slock = malloc(sizeof(*b.slock));
+        if (!b.slock) {
+            fprintf(stderr, "Error: Unable to allocate sched_lock\n");
+            return 1;
+        }
+        sched_lock_init(b.slock);
+    }
+    b.ring = calloc(b.capacity, sizeof(*b.ring));
+    if (!b.ring) {
+        fprintf(stderr, "Error: Unable to allocate ring\n");
+        return 1;
+    }
+    lock_cond_init(&b.not_empty);
+    lock_cond_init(&b.not_full);
+    b.producers_left = b.producers;
+
+    cpu = cpu_seconds();
+    start = now_ns();
+    b.end_time = start + duration_s * NSEC_PER_SEC;
+    for (i = 0; i < n; i++) {
+        fibers[i].bench = &b;
+        fibers[i].fid = i;
+        handles[i] = fiber_create(COND_BENCH_STACK, i < b.producers ? &producer : &consumer,
+                                  &fibers[i]);
+    }
+    for (i = 0; i < n; i++) {
+        fiber_join(handles[i], NULL);
+    }
+    wall = (double)(now_ns() - start) / NSEC_PER_SEC;
+    cpu = cpu_seconds() - cpu;
+
+    lock_cond_get_stats(&b.not_empty, &empty_stats);
+    lock_cond_get_stats(&b.not_full, &full_stats);
+    printf("lock %s mode %s producers %d consumers %d capacity %u items %llu "
+           "throughput(items/s) %.0f cpu(s) %.3f cpu_per_item(us) %.3f retries %llu "
+           "waits %llu wait(us) %llu\n",
+           lock_name, b.poll ? "poll" : "cond", b.producers, b.consumers, b.capacity,
+           (ull)b.consumed, b.consumed / wall, cpu,
+           b.consumed ? cpu * 1e6 / b.consumed : 0.0, (ull)b.retries,
+           (ull)(empty_stats.waits + full_stats.waits),
+           (ull)((empty_stats.wait_ns + full_stats.wait_ns) / NSEC_PER_USEC));
+
+    lock_cond_destroy(&b.not_empty);
+    lock_cond_destroy(&b.not_full);
+    free(b.ring);
+    if (b.use_fairlock) {
+        fairlock_destroy(b.flock);
+        free(b.flock);
+    } else {
+        sched_lock_destroy(b.slock);
+        free(b.slock);
+    }
+    ban_queue_shutdown();
+    return 0;
+}
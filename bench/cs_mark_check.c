@@ -0,0 +1,164 @@
+/*
+ * Checks the per-worker sched_lock critical-section mark (sched_cs_mark)
+ * when a holder migrates without taking its mark along, as it does when it
+ * blocks on a fiber_mutex, I/O or a sleep inside the critical section.
+ *
+ * usage: cs_mark_check
+ *
+ * Two threads stand in for two workers, and fiber keys are made up, so no
+ * fibers run. Steps are handed to one worker at a time. Exits non-zero if
+ * the releasing worker's depth wraps, or if a fiber looks like it is inside
+ * a critical section that belongs to another fiber.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "schedlock.h"
+
+#define FIBER_A ((uintptr_t)0x1000)
+#define FIBER_B ((uintptr_t)0x2000)
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    void (*step)(void);   // NULL once the step has run
+    int quit;
+};
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "Error: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+static void *worker_main(void *param)
+{
+    struct worker *w = param;
+
+    pthread_mutex_lock(&w->mutex);
+    while (!w->quit) {
+        if (w->step) {
+            w->step();
+            w->step = NULL;
+            pthread_cond_broadcast(&w->cond);
+        }
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+/* Run step on worker w and wait for it to finish. */
+static void run_on(struct worker *w, void (*step)(void))
+{
+    pthread_mutex_lock(&w->mutex);
+    w->step = step;
+    pthread_cond_broadcast(&w->cond);
+    while (w->step)
+        pthread_cond_wait(&w->cond, &w->mutex);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/* A takes two nested locks, then a preemption is put off. */
+static void a_enters_nested(void)
+{
+    sched_cs_enter(FIBER_A);
+    sched_cs_enter(FIBER_A);
+    sched_cs_mark.yield_pending = 1;
+    CHECK(sched_cs_held(FIBER_A));
+    CHECK(sched_cs_mark.depth == 2);
+}
+
+/* A has blocked without saving its mark; B now runs on the same worker. */
+static void b_runs_behind_a(void)
+{
+    CHECK(!sched_cs_held(FIBER_B));
+}
+
+/* A resumed here and releases both locks. */
+static void a_releases_migrated(void)
+{
+    CHECK(sched_cs_exit(FIBER_A) == 0);
+    CHECK(sched_cs_exit(FIBER_A) == 0);
+    CHECK(sched_cs_mark.depth == 0);
+    CHECK(!sched_cs_held(FIBER_A));
+    CHECK(!sched_cs_held(FIBER_B));
+}
+
+/* B takes and releases a lock; A's stale mark must not leak into it. */
+static void b_enters_and_exits(void)
+{
+    sched_cs_enter(FIBER_B);
+    CHECK(sched_cs_held(FIBER_B));
+    CHECK(sched_cs_mark.depth == 1);
+    CHECK(!sched_cs_mark.yield_pending);
+    CHECK(sched_cs_exit(FIBER_B) == 0);
+    CHECK(sched_cs_mark.depth == 0);
+    CHECK(!sched_cs_held(FIBER_B));
+}
+
+/* Without migration, the deferred preemption is due at the outermost release. */
+static void a_releases_in_place(void)
+{
+    sched_cs_enter(FIBER_A);
+    sched_cs_enter(FIBER_A);
+    sched_cs_mark.yield_pending = 1;
+    CHECK(sched_cs_exit(FIBER_A) == 0);
+    CHECK(sched_cs_exit(FIBER_A) == 1);
+    CHECK(sched_cs_mark.depth == 0);
+}
+
+static void worker_start(struct worker *w)
+{
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->step = NULL;
+    w->quit = 0;
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+        fprintf(stderr, "Error: Unable to create worker thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void worker_stop(struct worker *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+}
+
+int main(void)
+{
+    struct worker w1, w2;
+
+    timing_calibrate();
+    worker_start(&w1);
+    worker_start(&w2);
+
+    run_on(&w1, a_enters_nested);
+    run_on(&w1, b_runs_behind_a);
+    run_on(&w2, a_releases_migrated);
+    run_on(&w2, b_enters_and_exits);
+    run_on(&w1, b_enters_and_exits);
+    run_on(&w1, a_releases_in_place);
+
+    worker_stop(&w1);
+    worker_stop(&w2);
+
+    if (failures) {
+        fprintf(stderr, "Error: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("cs_mark_check: ok\n");
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Deterministic fairlock fairness simulation.
+ *
+ * Built with -DTIMING_SIMULATED, so now_ns() is a virtual clock that only
+ * this program moves. The fibers are simulated too: one thread plays all of
+ * them, in a discrete-event loop over the unmodified fairlock code. At each
+ * step the fiber that has been ready longest (ties to the lower fid, like
+ * ticket order) calls fair_trylock(). With nobody else running, that fails
+ * only on a ban. On success the clock advances by the fiber's critical
+ * section, fair_unlock() charges it, and the fiber is ready again after its
+ * think time. A banned fiber is ready again when its published ban
+ * (fairlock_ban_hint()) runs out.
+ *
+ * The same arguments always print the same numbers, whatever the machine or
+ * CYCLE_PER_US. That lets changes to the ban logic be compared across
+ * commits. Limits on the fairness metrics make the program exit non-zero, as
+ * uncontended_bench does, so a run can guard a regression:
+ *
+ *   fairness_sim -t 4 -c 1,10 -d 1000 -j 0.99 -e 0.05
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "fairlock.h"
+#include "timing.h"
+
+#ifndef TIMING_SIMULATED
+#error "fairness_sim needs the virtual clock: build with -DTIMING_SIMULATED"
+#endif
+
+#define SIM_MAX_FIBERS 1024
+
+typedef unsigned long long ull;
+
+struct sim_fiber {
+    int fid;
+    uint64_t cs_ns;
+    unsigned int weight;    // 0 = default
+    uint64_t ready_at;      // virtual ns at which it next tries the lock
+    uint64_t acquires;
+    uint64_t hold_ns;
+    uint64_t bans;          // tries refused for a ban
+};
+
+struct sim_config {
+    int nfibers;
+    uint64_t cs_ns[SIM_MAX_FIBERS];
+    int ncs;
+    unsigned int weights[SIM_MAX_FIBERS];
+    int nweights;
+    uint64_t think_ns;
+    uint64_t duration_ns;
+    double min_jain;        // fail if jain_hold drops below; 0 = no limit
+    double max_share_error; // fail if share_error rises above; 0 = no limit
+};
+
+/* Parse "a,b,c" into out (scaled by mult). Returns the count, or -1. */
+static int parse_list(const char *s, uint64_t *out, int max, uint64_t mult)
+{
+    char *end;
+    int n = 0;
+
+    while (*s) {
+        if (n == max)
+            return -1;
+        out[n++] = strtoull(s, &end, 10) * mult;
+        if (end == s || (*end && *end != ','))
+            return -1;
+        s = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n", prog);
+    printf("  -t N      simulated fibers (default 2)\n");
+    printf("  -c LIST   critical section in us per fiber, cycled (default 1,10)\n");
+    printf("  -g LIST   fairlock weight per fiber, cycled (default equal)\n");
+    printf("  -z US     think time between critical sections (default 0)\n");
+    printf("  -d MS     simulated duration (default 1000)\n");
+    printf("  -j X      exit non-zero if jain_hold < X\n");
+    printf("  -e X      exit non-zero if share_error > X\n");
+}
+
+/* The fiber that has waited longest among those ready by now, else the next to be. */
+static struct sim_fiber *sim_next(struct sim_fiber *fibers, int n)
+{
+    struct sim_fiber *best = &fibers[0];
+    int i;
+
+    for (i = 1; i < n; i++) {
+        if (fibers[i].ready_at < best->ready_at)
+            best = &fibers[i];
+    }
+    return best;
+}
+
+static void sim_run(struct sim_fiber *fibers, int n, const struct sim_config *config)
+{
+    struct fairlock *lock;
+    struct sim_fiber *f;
+    uint64_t ban;
+    int i;
+
+    lock = aligned_alloc(FAIRLOCK_CACHELINE, sizeof(*lock));
+    if (!lock) {
+        fprintf(stderr, "Error: Unable to allocate fairlock\n");
+        exit(EXIT_FAILURE);
+    }
+    timing_sim_set(0);
+    fairlock_init(lock);
+    for (i = 0; i < n; i++) {
+        if (fibers[i].weight != 0)
+            fairlock_set_weight(lock, fibers[i].fid, fibers[i].weight);
+    }
+
+    while (now_ns() < config->duration_ns) {
+        f = sim_next(fibers, n);
+        if (f->ready_at > now_ns())
+            timing_sim_set(f->ready_at);
+
+        if (!fair_trylock(lock, f->fid)) {
+            /* Banned: wait for the ban to run out, or retry after the others. */
+            ban = fairlock_ban_hint(lock, f->fid);
+            f->ready_at = ban > now_ns() ? ban : now_ns() + 1;
+            f->bans++;
+            continue;
+        }
+        timing_sim_advance(f->cs_ns);
+        fair_unlock(lock);
+        f->acquires++;
+        f->hold_ns += f->cs_ns;
+        f->ready_at = now_ns() + config->think_ns;
+    }
+
+    fairlock_destroy(lock);
+    free(lock);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct sim_config config;
+    struct sim_fiber *fibers;
+    uint64_t list[SIM_MAX_FIBERS];
+    double hold = 0, weight = 0, sum_sq = 0, jain, expected, err, share_error = 0;
+    uint64_t acquires = 0;
+    int opt, i, n, failed = 0;
+
+    config.nfibers = 2;
+    config.cs_ns[0] = 1 * NSEC_PER_USEC;
+    config.cs_ns[1] = 10 * NSEC_PER_USEC;
+    config.ncs = 2;
+    config.duration_ns = 1000ULL * 1000000ULL;
+
+    while ((opt = getopt(argc, argv, "t:c:g:z:d:j:e:h")) != -1) {
+        switch (opt) {
+        case 't':
+            config.nfibers = atoi(optarg);
+            break;
+        case 'c':
+            config.ncs = parse_list(optarg, config.cs_ns, SIM_MAX_FIBERS, NSEC_PER_USEC);
+            break;
+        case 'g':
+            n = parse_list(optarg, list, SIM_MAX_FIBERS, 1);
+            config.nweights = n;
+            for (i = 0; i < n; i++) {
+                config.weights[i] = (unsigned int)list[i];
+            }
+            break;
+        case 'z':
+            config.think_ns = strtoull(optarg, NULL, 10) * NSEC_PER_USEC;
+            break;
+        case 'd':
+            config.duration_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+            break;
+        case 'j':
+            config.min_jain = strtod(optarg, NULL);
+            break;
+        case 'e':
+            config.max_share_error = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.nfibers < 1 || config.nfibers > SIM_MAX_FIBERS || config.ncs < 1 ||
+        config.nweights < 0 || config.duration_ns == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    n = config.nfibers;
+    fibers = calloc(n, sizeof(*fibers));
+    if (!fibers) {
+        fprintf(stderr, "Error: Unable to allocate simulated fibers\n");
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        fibers[i].fid = i;
+        fibers[i].cs_ns = config.cs_ns[i % config.ncs];
+        fibers[i].weight = config.nweights ? config.weights[i % config.nweights] : 0;
+    }
+
+    sim_run(fibers, n, &config);
+
+    for (i = 0; i < n; i++) {
+        acquires += fibers[i].acquires;
+        hold += (double)fibers[i].hold_ns;
+        sum_sq += (double)fibers[i].hold_ns * fibers[i].hold_ns;
+        weight += fairlock_weight(fibers[i].weight);
+    }
+    jain = sum_sq > 0 ? hold * hold / (n * sum_sq) : 1.0;
+
+    for (i = 0; i < n; i++) {
+        expected = fairlock_weight(fibers[i].weight) / weight;
+        err = hold > 0 ? (fibers[i].hold_ns / hold - expected) / expected : 0;
+        if (err < 0)
+            err = -err;
+        if (err > share_error)
+            share_error = err;
+        printf("id %4d cs(us) %6llu weight %7u acquires %10llu hold(us) %12llu "
+               "share %.4f bans %10llu\n",
+               fibers[i].fid, (ull)(fibers[i].cs_ns / NSEC_PER_USEC),
+               fairlock_weight(fibers[i].weight), (ull)fibers[i].acquires,
+               (ull)(fibers[i].hold_ns / NSEC_PER_USEC),
+               hold > 0 ? fibers[i].hold_ns / hold : 0.0, (ull)fibers[i].bans);
+    }
+    printf("summary lock fairlock threads %d duration(ms) %llu acquires %llu "
+           "throughput(ops/s) %.0f utilisation %.4f jain_hold %.4f share_error %.4f\n",
+           n, (ull)(config.duration_ns / 1000000ULL), (ull)acquires,
+           acquires * (double)NSEC_PER_SEC / now_ns(), hold / now_ns(), jain, share_error);
+
+    if (config.min_jain > 0 && jain < config.min_jain) {
+        fprintf(stderr, "Error: jain_hold %.4f below %.4f\n", jain, config.min_jain);
+        failed = 1;
+    }
+    if (config.max_share_error > 0 && share_error > config.max_share_error) {
+        fprintf(stderr, "Error: share_error %.4f above %.4f\n", share_error,
+                config.max_share_error);
+        failed = 1;
+    }
+    free(fibers);
+    return failed;
+}
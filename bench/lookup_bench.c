@@ -0,0 +1,82 @@
+/*
+ * Waiter lookup microbenchmark: cost of a fairlock fid -> waiter lookup as the
+ * number of fibers known to the lock grows.
+ *
+ * usage: lookup_bench [lookups per size]
+ *
+ * For each table size the keys are inserted either sequentially (fid 0..n-1)
+ * or with a stride of 256, the pattern that used to collapse the old
+ * 256-bucket table into a single chain. Lookups hit random present keys.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hashmap.h"
+#include "timing.h"
+
+static const size_t sizes[] = {2, 16, 256, 1024, 4096, 16384, 65536, 100000};
+
+static double bench_lookup(size_t n, uintptr_t stride, size_t lookups)
+{
+    struct hashmap map;
+    uintptr_t *order;
+    uint64_t start, end;
+    size_t i, found = 0;
+
+    if (hashmap_init(&map, 9) != 0) {
+        fprintf(stderr, "Error: Unable to allocate hashmap\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++) {
+        /* Values only need to be non-NULL. */
+        if (hashmap_put(&map, i * stride, (void *)(i + 1)) != 0) {
+            fprintf(stderr, "Error: Unable to grow hashmap\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    order = malloc(lookups * sizeof(*order));
+    if (!order) {
+        fprintf(stderr, "Error: Unable to allocate lookup order\n");
+        exit(EXIT_FAILURE);
+    }
+    srand(42);
+    for (i = 0; i < lookups; i++) {
+        order[i] = (uintptr_t)(rand() % n) * stride;
+    }
+
+    start = now_ns();
+    for (i = 0; i < lookups; i++) {
+        found += hashmap_get(&map, order[i]) != NULL;
+    }
+    end = now_ns();
+
+    if (found != lookups) {
+        fprintf(stderr, "Error: %zu of %zu lookups missed\n", lookups - found, lookups);
+        exit(EXIT_FAILURE);
+    }
+
+    free(order);
+    hashmap_destroy(&map);
+    return (double)(end - start) / lookups;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    size_t i;
+
+    if (lookups == 0) {
+        printf("usage: %s [lookups per size]\n", argv[0]);
+        return 1;
+    }
+
+    timing_calibrate();
+    printf("%10s %16s %16s\n", "fibers", "seq ns/lookup", "stride256 ns/lookup");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf("%10zu %16.2f %16.2f\n", sizes[i],
+               bench_lookup(sizes[i], 1, lookups),
+               bench_lookup(sizes[i], 256, lookups));
+    }
+    return 0;
+}
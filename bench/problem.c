@@ -0,0 +1,1503 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "fiber_manager.h"
+#include "fairlock.h"
+#include "schedlock.h"
+#include "sched_rwlock.h"
+#include "hybridlock.h"
+
+#include "timing.h"
+#include "histogram.h"
+#include "lockstat.h"
+
+/*
+ * Lock benchmark. Every lock variant is built into the one binary and picked
+ * at runtime through struct bench_lock_ops, so a single invocation can sweep
+ * lock types x thread counts x repeats.
+ *
+ * Each fiber loops until the duration is up: pick one or more of the
+ * benchmark's locks (see enum bench_pattern), acquire them, spin for a
+ * critical section drawn from the CS distribution, release them, then spin
+ * outside the locks for a think time drawn from the think distribution. Per fiber, the usual "id .." line is printed;
+ * per run, a "run .." line with throughput, Jain's fairness index over lock
+ * hold time and acquire-latency percentiles; per configuration, a "summary .."
+ * line averaging the repeats.
+ */
+
+#define BENCH_MAX_THREADS     4096
+#define BENCH_MAX_SWEEP       64
+#define BENCH_MAX_LOCKS       4096
+#define BENCH_MAX_CS_VALUES   BENCH_MAX_THREADS
+#define BENCH_MAX_DURATION    (24 * 3600)
+#define BENCH_FIBER_STACK     10240
+#define BENCH_MAX_NEST        16
+
+typedef unsigned long long ull;
+typedef struct timespec timespec_t;
+
+
+/* ------------------------------------------------------------------ */
+/* Lock vtable                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Per-critical-section state the benchmark hands to acquire and release. */
+struct bench_hold {
+    int fid;
+    unsigned int weight;          // fairlock: fair-share weight, 0 = default
+    int write;                    // sched_rwlock: take the lock for writing
+    struct sched_rw_hold rw;
+};
+
+struct bench_lock_ops {
+    const char *name;
+    size_t size;
+    void (*init)(void *lock);
+    void (*acquire)(void *lock, struct bench_hold *hold);
+    void (*release)(void *lock, struct bench_hold *hold);
+    void (*destroy)(void *lock);
+    void (*report)(FILE *out, void *lock);   // optional, printed after each run (text only)
+    /* Optional: run fn(arg) as one critical section, possibly on another fiber. */
+    void (*combine)(void *lock, struct bench_hold *hold, void (*fn)(void *arg), void *arg);
+    /* Optional: charge the lock's holds to an accounting domain shared by the run's locks. */
+    void (*set_domain)(void *lock, struct lock_domain *domain);
+};
+
+/* Knobs for the lock variants that take them. */
+static unsigned int cohort_budget = 4;
+static unsigned int sched_fiber_slots = SCHED_LOCK_FIBER_SLOTS;
+
+struct bench_mutex {
+    fiber_mutex_t mutex;
+    LOCKSTAT_ONLY(struct lockstat stats;)
+    LOCKSTAT_ONLY(uint64_t start;)
+};
+
+static void mutex_init(void *lock)
+{
+    struct bench_mutex *m = lock;
+
+    fiber_mutex_init(&m->mutex);
+    LOCKSTAT_ONLY(lockstat_register(&m->stats, "fiber_mutex", m);)
+}
+
+static void mutex_acquire(void *lock, struct bench_hold *hold)
+{
+    struct bench_mutex *m = lock;
+    LOCKSTAT_ONLY(uint64_t wait_start = now_ns();)
+
+    fiber_mutex_lock(&m->mutex);
+    LOCKSTAT_ONLY(m->start = now_ns();)
+    LOCKSTAT_ONLY(lockstat_acquired(&m->stats, (uintptr_t)hold->fid, m->start - wait_start);)
+}
+
+static void mutex_release(void *lock, struct bench_hold *hold)
+{
+    struct bench_mutex *m = lock;
+
+    LOCKSTAT_ONLY(lockstat_released(&m->stats, now_ns() - m->start);)
+    fiber_mutex_unlock(&m->mutex);
+}
+
+static void mutex_destroy(void *lock)
+{
+    struct bench_mutex *m = lock;
+
+    LOCKSTAT_ONLY(lockstat_unregister(&m->stats);)
+    fiber_mutex_destroy(&m->mutex);
+}
+
+static void fairlock_bench_init(void *lock)
+{
+    fairlock_init(lock);
+}
+
+static void fairlock_queue_init(void *lock)
+{
+    fairlock_init(lock);
+    fairlock_set_mode(lock, FAIRLOCK_QUEUE);
+}
+
+static void fairlock_acquire(void *lock, struct bench_hold *hold)
+{
+    fair_lock_weighted(lock, hold->fid, hold->weight);
+}
+
+static void fairlock_combine(void *lock, struct bench_hold *hold, void (*fn)(void *arg), void *arg)
+{
+    fair_combine_weighted(lock, hold->fid, hold->weight, fn, arg);
+}
+
+static void fairlock_release(void *lock, struct bench_hold *hold)
+{
+    fair_unlock(lock);
+}
+
+static void fairlock_bench_destroy(void *lock)
+{
+    fairlock_destroy(lock);
+}
+
+static void fairlock_bench_set_domain(void *lock, struct lock_domain *domain)
+{
+    fairlock_set_domain(lock, domain);
+}
+
+static void schedlock_init(void *lock)
+{
+    struct sched_lock_config config = SCHED_LOCK_CONFIG_DEFAULT;
+
+    config.fiber_slots = sched_fiber_slots;
+    sched_lock_init_config(lock, &config);
+}
+
+static void schedlock_adaptive_init(void *lock)
+{
+    struct sched_lock_config config = SCHED_LOCK_CONFIG_DEFAULT;
+
+    config.adaptive = 1;
+    config.fiber_slots = sched_fiber_slots;
+    sched_lock_init_config(lock, &config);
+}
+
+static void schedlock_cohort_init(void *lock)
+{
+    schedlock_init(lock);
+    sched_lock_set_cohort(lock, SCHED_COHORT_NODE, cohort_budget);
+}
+
+static void schedlock_acquire(void *lock, struct bench_hold *hold)
+{
+    sched_lock_acquire(lock);
+}
+
+static void schedlock_release(void *lock, struct bench_hold *hold)
+{
+    sched_lock_release(lock);
+}
+
+static void schedlock_destroy(void *lock)
+{
+    sched_lock_destroy(lock);
+}
+
+static void schedlock_set_domain(void *lock, struct lock_domain *domain)
+{
+    sched_lock_set_domain(lock, domain);
+}
+
+/*
+ * Preemption-avoidance counters are process-wide; print what this run added.
+ * Deferred and expired preemptions (and the yields they force) are counted
+ * only by a scheduler that calls sched_lock_preempt_check(), which libfiber
+ * does not, so only voluntary switches inside a critical section are shown.
+ */
+static void schedlock_report(FILE *out, void *lock)
+{
+    static struct sched_lock_preempt_stats last;
+    struct sched_lock_preempt_stats now;
+
+    sched_lock_get_preempt_stats(&now);
+    fprintf(out, "switched_in_cs %8llu\n", (ull)(now.switched_in_cs - last.switched_in_cs));
+    last = now;
+}
+
+/* Ban-queue counters are process-wide too; only locks that ban fibers add to them. */
+static void ban_queue_report(FILE *out)
+{
+    static struct ban_queue_stats last;
+    struct ban_queue_stats now;
+    uint64_t woken;
+
+    ban_queue_get_stats(&now);
+    if (now.parked == last.parked)
+        return;
+    woken = (now.woken_by_poll - last.woken_by_poll) +
+            (now.woken_by_timer - last.woken_by_timer);
+    fprintf(out, "ban_parked %8llu "
+                 "woken_by_poll %8llu "
+                 "woken_by_timer %8llu "
+                 "avg_late(ns) %8llu\n",
+                 (ull)(now.parked - last.parked),
+                 (ull)(now.woken_by_poll - last.woken_by_poll),
+                 (ull)(now.woken_by_timer - last.woken_by_timer),
+                 (ull)(woken ? (now.late_ns - last.late_ns) / woken : 0));
+    last = now;
+}
+
+static void schedlock_adaptive_report(FILE *out, void *lock)
+{
+    struct sched_lock_slice_stats slice_stats;
+
+    schedlock_report(out, lock);
+    sched_lock_get_slice_stats(lock, &slice_stats);
+    fprintf(out, "slices %8llu "
+                 "adjustments %8llu "
+                 "slice(us) %6llu "
+                 "min %6llu "
+                 "max %6llu "
+                 "cs_ewma(ns) %8llu\n",
+                 (ull)slice_stats.slices,
+                 (ull)slice_stats.adjustments,
+                 (ull)(slice_stats.slice_ns / NSEC_PER_USEC),
+                 (ull)(slice_stats.min_slice_ns / NSEC_PER_USEC),
+                 (ull)(slice_stats.max_slice_ns / NSEC_PER_USEC),
+                 (ull)slice_stats.cs_ewma_ns);
+}
+
+static void rwlock_init(void *lock)
+{
+    sched_rwlock_init(lock);
+}
+
+static void rwlock_acquire(void *lock, struct bench_hold *hold)
+{
+    if (hold->write)
+        sched_write_acquire(lock, &hold->rw);
+    else
+        sched_read_acquire(lock, &hold->rw);
+}
+
+static void rwlock_release(void *lock, struct bench_hold *hold)
+{
+    if (hold->write)
+        sched_write_release(lock, &hold->rw);
+    else
+        sched_read_release(lock, &hold->rw);
+}
+
+static void rwlock_destroy(void *lock)
+{
+    sched_rwlock_destroy(lock);
+}
+
+static void hybridlock_bench_init(void *lock)
+{
+    hybridlock_init(lock);
+}
+
+static void hybridlock_acquire(void *lock, struct bench_hold *hold)
+{
+    hybrid_lock(lock);
+}
+
+static void hybridlock_release(void *lock, struct bench_hold *hold)
+{
+    hybrid_unlock(lock);
+}
+
+static void hybridlock_bench_destroy(void *lock)
+{
+    hybridlock_destroy(lock);
+}
+
+static void hybridlock_report(FILE *out, void *lock)
+{
+    struct hybridlock_stats stats;
+
+    hybridlock_get_stats(lock, &stats);
+    fprintf(out, "mode %6s "
+                 "contended(%%) %5.1f "
+                 "fair_acquires(%%) %5.1f "
+                 "to_fair %6llu "
+                 "to_mutex %6llu\n",
+                 stats.mode == HYBRID_FAIR ? "fair" : "mutex",
+                 stats.acquires ? 100.0 * stats.contended / stats.acquires : 0.0,
+                 stats.acquires ? 100.0 * stats.fair_acquires / stats.acquires : 0.0,
+                 (ull)stats.to_fair,
+                 (ull)stats.to_mutex);
+}
+
+static const struct bench_lock_ops bench_locks[] = {
+    {"mutex", sizeof(struct bench_mutex),
+     mutex_init, mutex_acquire, mutex_release, mutex_destroy, NULL},
+    {"fairlock", sizeof(struct fairlock),
+     fairlock_bench_init, fairlock_acquire, fairlock_release, fairlock_bench_destroy, NULL,
+     NULL, fairlock_bench_set_domain},
+    {"fairlock_queue", sizeof(struct fairlock),
+     fairlock_queue_init, fairlock_acquire, fairlock_release, fairlock_bench_destroy, NULL,
+     NULL, fairlock_bench_set_domain},
+    {"fairlock_combine", sizeof(struct fairlock),
+     fairlock_bench_init, fairlock_acquire, fairlock_release, fairlock_bench_destroy, NULL,
+     fairlock_combine, fairlock_bench_set_domain},
+    {"schedlock", sizeof(struct sched_lock),
+     schedlock_init, schedlock_acquire, schedlock_release, schedlock_destroy, schedlock_report,
+     NULL, schedlock_set_domain},
+    {"schedlock_adaptive", sizeof(struct sched_lock),
+     schedlock_adaptive_init, schedlock_acquire, schedlock_release, schedlock_destroy,
+     schedlock_adaptive_report, NULL, schedlock_set_domain},
+    {"schedlock_cohort", sizeof(struct sched_lock),
+     schedlock_cohort_init, schedlock_acquire, schedlock_release, schedlock_destroy, schedlock_report,
+     NULL, schedlock_set_domain},
+    {"sched_rwlock", sizeof(struct sched_rwlock),
+     rwlock_init, rwlock_acquire, rwlock_release, rwlock_destroy, NULL},
+    {"hybridlock", sizeof(struct hybridlock),
+     hybridlock_bench_init, hybridlock_acquire, hybridlock_release, hybridlock_bench_destroy,
+     hybridlock_report},
+};
+
+#define BENCH_NUM_LOCK_TYPES ((int)(sizeof(bench_locks) / sizeof(bench_locks[0])))
+
+static const struct bench_lock_ops *find_lock_ops(const char *name)
+{
+    int i;
+
+    for (i = 0; i < BENCH_NUM_LOCK_TYPES; i++) {
+        if (strcmp(bench_locks[i].name, name) == 0)
+            return &bench_locks[i];
+    }
+    return NULL;
+}
+
+
+/* ------------------------------------------------------------------ */
+/* Workload                                                            */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Critical-section and think-time distributions, all in microseconds:
+ *   N           every section takes N
+ *   A,B,C...    fiber i always takes the (i mod count)-th value
+ *   uniform:A-B drawn uniformly from [A, B] for each section
+ *   exp:M       drawn from an exponential distribution with mean M
+ */
+enum dist_kind {
+    DIST_FIXED = 0,
+    DIST_LIST,
+    DIST_UNIFORM,
+    DIST_EXP,
+};
+
+struct dist {
+    int kind;
+    ull a, b;                     // fixed value / uniform bounds / exp mean
+    ull *values;                  // DIST_LIST
+    int nvalues;
+};
+
+/*
+ * How a fiber picks locks for one critical section:
+ *   random   one lock, uniformly
+ *   sharded  one lock, the shard of a key drawn from a keyspace (hash-table
+ *            style); hot_pct percent of the keys come from the hottest 1%
+ *   nested   nest distinct locks, taken in index order, released in reverse
+ */
+enum bench_pattern {
+    BENCH_RANDOM = 0,
+    BENCH_SHARDED,
+    BENCH_NESTED,
+};
+
+static const char *bench_pattern_names[] = {"random", "sharded", "nested"};
+
+enum bench_format {
+    BENCH_TEXT = 0,
+    BENCH_CSV,
+    BENCH_JSON,
+};
+
+/*
+ * The sweep is lock_types x threads x durations x cs_ratios, each point run
+ * `repeats` times in this process. With cs_ratios set, the critical section
+ * must be a fixed value A, and for ratio R even fibers take A and odd fibers
+ * A * R.
+ */
+struct bench_config {
+    const struct bench_lock_ops *lock_types[BENCH_NUM_LOCK_TYPES];
+    int nlock_types;
+    int threads[BENCH_MAX_SWEEP];
+    int nthread_counts;
+    ull durations[BENCH_MAX_SWEEP];   // seconds
+    int ndurations;
+    ull cs_ratios[BENCH_MAX_SWEEP];
+    int ncs_ratios;
+    struct dist cs;
+    struct dist think;
+    struct dist weights;          // per-fiber fair-share weights (fixed or list)
+    const char *cs_spec;
+    const char *think_spec;
+    const char *weights_spec;
+    int nlocks;                   // locks shared by the fibers of one run
+    int pattern;                  // enum bench_pattern
+    int nest;                     // nested: locks per critical section
+    ull keys;                     // sharded: keyspace size
+    int hot_pct;                  // sharded: share of operations on the hottest 1% of keys
+    int repeats;
+    int write_every;              // sched_rwlock: one write per write_every sections
+    int workers;                  // kernel threads, 0 = largest thread count
+    int domain;                   // one accounting domain across a run's locks
+    int quiet;                    // no per-fiber lines
+    int format;                   // enum bench_format
+    FILE *out;                    // where records go
+};
+
+/* One benchmark run: one point of the sweep. */
+struct bench_run {
+    const struct bench_config *config;
+    const struct bench_lock_ops *ops;
+    void **locks;
+    int nlocks;
+    int nthreads;
+    ull duration;
+    const struct dist *cs;
+    const char *cs_spec;
+    int repeat;
+};
+
+typedef struct {
+    int id;
+    const struct bench_run *run;
+    ull num_lock_acquired;
+    ull loop_count_in_cs;
+    ull lock_hold_time;    // us
+    uint64_t start_time;   // ns, now_ns() clock
+    ull duration;
+    uint64_t rng;
+    struct histogram wait; // ns from acquire call to entering the critical section
+} task_t;
+
+/* xorshift64*: cheap, per fiber, and plenty for picking locks and section lengths. */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t dist_sample_ns(const struct dist *d, int id, uint64_t *rng)
+{
+    double u;
+
+    switch (d->kind) {
+    case DIST_LIST:
+        return d->values[id % d->nvalues] * NSEC_PER_USEC;
+    case DIST_UNIFORM:
+        return (d->a * NSEC_PER_USEC) +
+               bench_rand(rng) % ((d->b - d->a) * NSEC_PER_USEC + 1);
+    case DIST_EXP:
+        /* u in (0, 1], so log(u) is finite. */
+        u = ((double)(bench_rand(rng) >> 11) + 1.0) / 9007199254740992.0;
+        return (uint64_t)(-log(u) * (double)(d->a * NSEC_PER_USEC));
+    default:
+        return d->a * NSEC_PER_USEC;
+    }
+}
+
+static inline int dist_is_zero(const struct dist *d)
+{
+    return d->kind == DIST_FIXED && d->a == 0;
+}
+
+/* Configured weight of fiber id; 0 when none was given. */
+static inline unsigned int bench_weight(const struct bench_config *config, int id)
+{
+    if (config->weights.kind == DIST_LIST)
+        return (unsigned int)config->weights.values[id % config->weights.nvalues];
+    return (unsigned int)config->weights.a;
+}
+
+
+/* ------------------------------------------------------------------ */
+/* Argument parsing                                                    */
+/* ------------------------------------------------------------------ */
+
+static int parse_ull(const char *s, ull min, ull max, ull *out)
+{
+    char *end;
+    ull v;
+
+    if (!s || *s == '\0' || *s == '-')
+        return -1;
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno != 0 || *end != '\0' || v < min || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+static int parse_int(const char *s, int min, int max, int *out)
+{
+    ull v;
+
+    if (parse_ull(s, (ull)min, (ull)max, &v) != 0)
+        return -1;
+    *out = (int)v;
+    return 0;
+}
+
+/* Split a comma-separated list in place. Returns the number of items, or -1 if more than max. */
+static int split_list(char *s, char **items, int max)
+{
+    int n = 0;
+    char *tok, *save;
+
+    for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n == max)
+            return -1;
+        items[n++] = tok;
+    }
+    return n;
+}
+
+static int parse_dist(const char *spec, struct dist *d)
+{
+    char buf[64];
+    char *dash;
+    char *items[BENCH_MAX_CS_VALUES];
+    char *copy;
+    int n, i;
+
+    memset(d, 0, sizeof(*d));
+    if (strncmp(spec, "uniform:", 8) == 0) {
+        if (strlen(spec + 8) >= sizeof(buf))
+            return -1;
+        strcpy(buf, spec + 8);
+        dash = strchr(buf, '-');
+        if (!dash)
+            return -1;
+        *dash = '\0';
+        d->kind = DIST_UNIFORM;
+        if (parse_ull(buf, 0, NSEC_PER_SEC, &d->a) != 0 ||
+            parse_ull(dash + 1, d->a, NSEC_PER_SEC, &d->b) != 0)
+            return -1;
+        return 0;
+    }
+    if (strncmp(spec, "exp:", 4) == 0) {
+        d->kind = DIST_EXP;
+        return parse_ull(spec + 4, 1, NSEC_PER_SEC, &d->a);
+    }
+    if (!strchr(spec, ',')) {
+        d->kind = DIST_FIXED;
+        return parse_ull(spec, 0, NSEC_PER_SEC, &d->a);
+    }
+
+    copy = strdup(spec);
+    if (!copy)
+        return -1;
+    n = split_list(copy, items, BENCH_MAX_CS_VALUES);
+    if (n <= 0) {
+        free(copy);
+        return -1;
+    }
+    d->kind = DIST_LIST;
+    d->values = calloc(n, sizeof(*d->values));
+    d->nvalues = n;
+    for (i = 0; d->values && i < n; i++) {
+        if (parse_ull(items[i], 0, NSEC_PER_SEC, &d->values[i]) != 0) {
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return d->values ? 0 : -1;
+}
+
+static int parse_locks(const char *spec, struct bench_config *config)
+{
+    char *items[BENCH_NUM_LOCK_TYPES];
+    char *copy = strdup(spec);
+    int n, i;
+
+    if (!copy)
+        return -1;
+    if (strcmp(spec, "all") == 0) {
+        for (i = 0; i < BENCH_NUM_LOCK_TYPES; i++) {
+            config->lock_types[i] = &bench_locks[i];
+        }
+        config->nlock_types = BENCH_NUM_LOCK_TYPES;
+        free(copy);
+        return 0;
+    }
+    n = split_list(copy, items, BENCH_NUM_LOCK_TYPES);
+    for (i = 0; i < n; i++) {
+        config->lock_types[i] = find_lock_ops(items[i]);
+        if (!config->lock_types[i]) {
+            fprintf(stderr, "Error: Unknown lock '%s'\n", items[i]);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    if (n <= 0)
+        return -1;
+    config->nlock_types = n;
+    return 0;
+}
+
+/* Parse a comma-separated sweep of values in [min, max]. Returns the count, or -1. */
+static int parse_sweep(const char *spec, ull min, ull max, ull *out)
+{
+    char *items[BENCH_MAX_SWEEP];
+    char *copy = strdup(spec);
+    int n, i;
+
+    if (!copy)
+        return -1;
+    n = split_list(copy, items, BENCH_MAX_SWEEP);
+    for (i = 0; i < n; i++) {
+        if (parse_ull(items[i], min, max, &out[i]) != 0) {
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return n > 0 ? n : -1;
+}
+
+static int parse_threads(const char *spec, struct bench_config *config)
+{
+    ull threads[BENCH_MAX_SWEEP];
+    int n, i;
+
+    n = parse_sweep(spec, 1, BENCH_MAX_THREADS, threads);
+    if (n < 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        config->threads[i] = (int)threads[i];
+    }
+    config->nthread_counts = n;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    int i;
+
+    printf("usage: %s [options] [<nthreads> <duration> <critical section 1> <critical section 2> ...]\n", prog);
+    printf("nthreads - number of threads\n");
+    printf("duration - duration of the experiment in seconds (s)\n");
+    printf("critical section - critical section size in microseconds (us), one per thread, reused cyclically\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -l, --lock LIST         locks to compare, comma-separated, or 'all' (default mutex)\n");
+    printf("  -t, --threads LIST      thread counts to sweep, comma-separated\n");
+    printf("  -d, --duration LIST     seconds per run, comma-separated to sweep (default 5)\n");
+    printf("  -c, --cs DIST           critical section length in us (default 1)\n");
+    printf("  -R, --cs-ratio LIST     sweep odd:even critical-section ratios (needs a fixed --cs)\n");
+    printf("  -n, --think DIST        time spent outside the lock per iteration in us (default 0)\n");
+    printf("  -g, --weights LIST      per-thread fair-share weights, reused cyclically (fairlock)\n");
+    printf("  -L, --locks N           number of locks (default 1)\n");
+    printf("  -P, --pattern PAT       how locks are picked: random, sharded or nested (default random)\n");
+    printf("  -N, --nest N            nested: locks held per critical section (default 2)\n");
+    printf("  -K, --keys N            sharded: keyspace size (default 16 per lock)\n");
+    printf("  -H, --hot PCT           sharded: percent of operations on the hottest 1%% of keys (default 0)\n");
+    printf("  -r, --repeat N          runs per configuration (default 1)\n");
+    printf("  -w, --workers N         kernel threads (default: largest thread count)\n");
+    printf("  -W, --write-every N     sched_rwlock: one write per N sections (default 10)\n");
+    printf("  -b, --cohort-budget N   schedlock_cohort: consecutive slices per NUMA node (default 4)\n");
+    printf("  -D, --domain            charge usage across all of a run's locks (fairlock, schedlock)\n");
+    printf("  -q, --quiet             no per-thread lines\n");
+    printf("  -f, --format FMT        text, csv or json (one object per line) (default text)\n");
+    printf("  -o, --output FILE       write results to FILE instead of stdout\n");
+    printf("\n");
+    printf("DIST: N | A,B,C (per thread) | uniform:A-B | exp:MEAN\n");
+    printf("locks:");
+    for (i = 0; i < BENCH_NUM_LOCK_TYPES; i++) {
+        printf(" %s", bench_locks[i].name);
+    }
+    printf("\n");
+}
+
+static int parse_args(int argc, char *argv[], struct bench_config *config)
+{
+    static const struct option long_options[] = {
+        {"lock",          required_argument, NULL, 'l'},
+        {"threads",       required_argument, NULL, 't'},
+        {"duration",      required_argument, NULL, 'd'},
+        {"cs",            required_argument, NULL, 'c'},
+        {"cs-ratio",      required_argument, NULL, 'R'},
+        {"think",         required_argument, NULL, 'n'},
+        {"weights",       required_argument, NULL, 'g'},
+        {"locks",         required_argument, NULL, 'L'},
+        {"pattern",       required_argument, NULL, 'P'},
+        {"nest",          required_argument, NULL, 'N'},
+        {"keys",          required_argument, NULL, 'K'},
+        {"hot",           required_argument, NULL, 'H'},
+        {"repeat",        required_argument, NULL, 'r'},
+        {"workers",       required_argument, NULL, 'w'},
+        {"write-every",   required_argument, NULL, 'W'},
+        {"cohort-budget", required_argument, NULL, 'b'},
+        {"domain",        no_argument,       NULL, 'D'},
+        {"quiet",         no_argument,       NULL, 'q'},
+        {"format",        required_argument, NULL, 'f'},
+        {"output",        required_argument, NULL, 'o'},
+        {"help",          no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int have_cs = 0, have_threads = 0, have_duration = 0;
+    int opt, budget, rest;
+    char *cs_list;
+    size_t len;
+    int i;
+
+    memset(config, 0, sizeof(*config));
+    config->lock_types[0] = find_lock_ops("mutex");
+    config->nlock_types = 1;
+    config->durations[0] = 5;
+    config->ndurations = 1;
+    config->cs.a = 1;
+    config->cs_spec = "1";
+    config->think_spec = "0";
+    config->weights_spec = "";
+    config->nlocks = 1;
+    config->nest = 2;
+    config->repeats = 1;
+    config->write_every = 10;
+
+    while ((opt = getopt_long(argc, argv, "l:t:d:c:R:n:g:L:P:N:K:H:r:w:W:b:Dqf:o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            if (parse_locks(optarg, config) != 0)
+                return -1;
+            break;
+        case 't':
+            if (parse_threads(optarg, config) != 0) {
+                fprintf(stderr, "Error: Bad thread counts '%s' (1..%d, at most %d)\n",
+                        optarg, BENCH_MAX_THREADS, BENCH_MAX_SWEEP);
+                return -1;
+            }
+            have_threads = 1;
+            break;
+        case 'd':
+            config->ndurations = parse_sweep(optarg, 1, BENCH_MAX_DURATION, config->durations);
+            if (config->ndurations < 0) {
+                fprintf(stderr, "Error: Bad duration '%s'\n", optarg);
+                return -1;
+            }
+            have_duration = 1;
+            break;
+        case 'c':
+            if (parse_dist(optarg, &config->cs) != 0) {
+                fprintf(stderr, "Error: Bad critical section spec '%s'\n", optarg);
+                return -1;
+            }
+            config->cs_spec = optarg;
+            have_cs = 1;
+            break;
+        case 'R':
+            config->ncs_ratios = parse_sweep(optarg, 1, 1000000, config->cs_ratios);
+            if (config->ncs_ratios < 0) {
+                fprintf(stderr, "Error: Bad critical section ratios '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            if (parse_dist(optarg, &config->think) != 0) {
+                fprintf(stderr, "Error: Bad think time spec '%s'\n", optarg);
+                return -1;
+            }
+            config->think_spec = optarg;
+            break;
+        case 'g':
+            if (parse_dist(optarg, &config->weights) != 0 ||
+                (config->weights.kind != DIST_FIXED && config->weights.kind != DIST_LIST)) {
+                fprintf(stderr, "Error: Bad weights '%s'\n", optarg);
+                return -1;
+            }
+            config->weights_spec = optarg;
+            break;
+        case 'L':
+            if (parse_int(optarg, 1, BENCH_MAX_LOCKS, &config->nlocks) != 0) {
+                fprintf(stderr, "Error: Bad lock count '%s' (1..%d)\n", optarg, BENCH_MAX_LOCKS);
+                return -1;
+            }
+            break;
+        case 'P':
+            for (i = 0; i < (int)(sizeof(bench_pattern_names) / sizeof(bench_pattern_names[0])); i++) {
+                if (strcmp(optarg, bench_pattern_names[i]) == 0)
+                    break;
+            }
+            if (i == (int)(sizeof(bench_pattern_names) / sizeof(bench_pattern_names[0]))) {
+                fprintf(stderr, "Error: Unknown pattern '%s'\n", optarg);
+                return -1;
+            }
+            config->pattern = i;
+            break;
+        case 'N':
+            if (parse_int(optarg, 1, BENCH_MAX_NEST, &config->nest) != 0) {
+                fprintf(stderr, "Error: Bad nesting depth '%s' (1..%d)\n", optarg, BENCH_MAX_NEST);
+                return -1;
+            }
+            break;
+        case 'K':
+            if (parse_ull(optarg, 1, 1ULL << 40, &config->keys) != 0) {
+                fprintf(stderr, "Error: Bad keyspace size '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'H':
+            if (parse_int(optarg, 0, 100, &config->hot_pct) != 0) {
+                fprintf(stderr, "Error: Bad hot percentage '%s' (0..100)\n", optarg);
+                return -1;
+            }
+            break;
+        case 'r':
+            if (parse_int(optarg, 1, 1000, &config->repeats) != 0) {
+                fprintf(stderr, "Error: Bad repeat count '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            if (parse_int(optarg, 1, BENCH_MAX_THREADS, &config->workers) != 0) {
+                fprintf(stderr, "Error: Bad worker count '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'W':
+            if (parse_int(optarg, 1, 1 << 30, &config->write_every) != 0) {
+                fprintf(stderr, "Error: Bad write ratio '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'b':
+            if (parse_int(optarg, 1, 1 << 20, &budget) != 0) {
+                fprintf(stderr, "Error: Bad cohort budget '%s'\n", optarg);
+                return -1;
+            }
+            cohort_budget = (unsigned int)budget;
+            break;
+        case 'D':
+            config->domain = 1;
+            break;
+        case 'q':
+            config->quiet = 1;
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                config->format = BENCH_TEXT;
+            } else if (strcmp(optarg, "csv") == 0) {
+                config->format = BENCH_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                config->format = BENCH_JSON;
+            } else {
+                fprintf(stderr, "Error: Unknown format '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'o':
+            config->out = fopen(optarg, "w");
+            if (!config->out) {
+                fprintf(stderr, "Error: Unable to open %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    /* Positional form: <nthreads> <duration> <cs>... */
+    rest = argc - optind;
+    if (rest == 0 && optind == 1)
+        return -1;
+    if (rest >= 1) {
+        if (have_threads || parse_threads(argv[optind], config) != 0 || config->nthread_counts != 1) {
+            fprintf(stderr, "Error: Bad nthreads '%s' (1..%d)\n", argv[optind], BENCH_MAX_THREADS);
+            return -1;
+        }
+        have_threads = 1;
+    }
+    if (rest >= 2) {
+        if (have_duration || parse_ull(argv[optind + 1], 1, BENCH_MAX_DURATION, &config->durations[0]) != 0) {
+            fprintf(stderr, "Error: Bad duration '%s'\n", argv[optind + 1]);
+            return -1;
+        }
+    }
+    if (rest >= 3) {
+        if (have_cs || rest - 2 > BENCH_MAX_CS_VALUES) {
+            fprintf(stderr, "Error: Give critical sections either with --cs or positionally (at most %d)\n",
+                    BENCH_MAX_CS_VALUES);
+            return -1;
+        }
+        for (len = 0, i = optind + 2; i < argc; i++) {
+            len += strlen(argv[i]) + 1;
+        }
+        cs_list = malloc(len + 1);
+        if (!cs_list)
+            return -1;
+        cs_list[0] = '\0';
+        for (i = optind + 2; i < argc; i++) {
+            strcat(cs_list, argv[i]);
+            strcat(cs_list, ",");
+        }
+        if (parse_dist(cs_list, &config->cs) != 0) {
+            fprintf(stderr, "Error: Bad critical section sizes\n");
+            free(cs_list);
+            return -1;
+        }
+        cs_list[strlen(cs_list) - 1] = '\0';
+        config->cs_spec = cs_list;
+    }
+    if (!have_threads) {
+        config->threads[0] = 2;
+        config->nthread_counts = 1;
+    }
+    if (config->pattern == BENCH_NESTED && config->nest > config->nlocks) {
+        fprintf(stderr, "Error: --nest %d needs at least that many --locks\n", config->nest);
+        return -1;
+    }
+    if (config->keys == 0)
+        config->keys = (ull)config->nlocks * 16;
+    if (config->ncs_ratios > 0 && config->cs.kind != DIST_FIXED) {
+        fprintf(stderr, "Error: --cs-ratio needs a single fixed critical section size\n");
+        return -1;
+    }
+    if (!config->out)
+        config->out = stdout;
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------ */
+/* Running                                                             */
+/* ------------------------------------------------------------------ */
+
+/* Fill idx with the locks for the next critical section, in acquisition order. Returns how many. */
+static int pick_locks(const struct bench_run *run, task_t *task, int *idx)
+{
+    const struct bench_config *config = run->config;
+    ull key, hot_keys;
+    int n, i, j, v;
+
+    if (run->nlocks == 1) {
+        idx[0] = 0;
+        return 1;
+    }
+
+    switch (config->pattern) {
+    case BENCH_SHARDED:
+        hot_keys = config->keys / 100 + 1;
+        if (config->hot_pct > 0 && (int)(bench_rand(&task->rng) % 100) < config->hot_pct)
+            key = bench_rand(&task->rng) % hot_keys;
+        else
+            key = bench_rand(&task->rng) % config->keys;
+        idx[0] = (int)(((key * 0x9E3779B97F4A7C15ULL) >> 32) % run->nlocks);
+        return 1;
+    case BENCH_NESTED:
+        /* Distinct locks, sorted so that every fiber takes them in the same order. */
+        for (n = 0; n < config->nest; ) {
+            v = (int)(bench_rand(&task->rng) % run->nlocks);
+            for (i = 0; i < n && idx[i] < v; i++) {
+            }
+            if (i < n && idx[i] == v)
+                continue;
+            for (j = n; j > i; j--) {
+                idx[j] = idx[j - 1];
+            }
+            idx[i] = v;
+            n++;
+        }
+        return n;
+    default:
+        idx[0] = (int)(bench_rand(&task->rng) % run->nlocks);
+        return 1;
+    }
+}
+
+/* One critical section: spin for cs_ns. May run on the combining fiber. */
+struct bench_cs {
+    uint64_t cs_ns;
+    uint64_t start;
+    uint64_t end;
+    ull loops;
+};
+
+static void bench_cs_run(void *arg)
+{
+    struct bench_cs *cs = arg;
+
+    cs->start = now_ns();
+    do {
+        cs->loops++;
+        cs->end = now_ns();
+    } while (cs->end - cs->start < cs->cs_ns);
+}
+
+void* run_func(void* param) {
+    task_t *task = (task_t *)param;
+    const struct bench_run *run = task->run;
+    const struct bench_config *config = run->config;
+    const struct bench_lock_ops *ops = run->ops;
+    struct bench_hold hold[BENCH_MAX_NEST];
+    int idx[BENCH_MAX_NEST];
+    struct bench_cs cs = {0};
+    int think = !dist_is_zero(&config->think);
+    int nheld, write, i;
+
+    uint64_t now, think_start, think_ns;
+    uint64_t end_time = task->start_time + task->duration * NSEC_PER_SEC;
+    ull lock_acquires = 0;
+    ull lock_hold = 0;
+    ull loop_in_cs = 0;
+
+    for (i = 0; i < BENCH_MAX_NEST; i++) {
+        hold[i].fid = task->id;
+        hold[i].weight = bench_weight(config, task->id);
+    }
+    now = now_ns();
+
+    while (now < end_time) {
+        nheld = pick_locks(run, task, idx);
+        cs.cs_ns = dist_sample_ns(run->cs, task->id, &task->rng);
+        cs.loops = 0;
+        write = (lock_acquires % config->write_every) == 0;
+
+        if (ops->combine && nheld == 1) {
+            hold[0].write = write;
+            ops->combine(run->locks[idx[0]], &hold[0], bench_cs_run, &cs);
+        } else {
+            for (i = 0; i < nheld; i++) {
+                hold[i].write = write;
+                ops->acquire(run->locks[idx[i]], &hold[i]);
+            }
+            bench_cs_run(&cs);
+            for (i = nheld - 1; i >= 0; i--) {
+                ops->release(run->locks[idx[i]], &hold[i]);
+            }
+        }
+
+        histogram_record(&task->wait, cs.start - now);
+        lock_acquires++;
+        loop_in_cs += cs.loops;
+        lock_hold += cs.end - cs.start;
+
+        now = now_ns();
+        if (think) {
+            think_ns = dist_sample_ns(&config->think, task->id, &task->rng);
+            think_start = now;
+            while (now - think_start < think_ns) {
+                now = now_ns();
+            }
+        }
+    }
+
+    task->num_lock_acquired = lock_acquires;
+    task->loop_count_in_cs = loop_in_cs;
+    task->lock_hold_time = lock_hold / NSEC_PER_USEC;
+
+    return NULL;
+}
+
+/* Jain's fairness index: 1 when every fiber got the same, 1/n when one got everything. */
+static double jain_index(const task_t *tasks, int n, int use_hold)
+{
+    double sum = 0, sum_sq = 0, x;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        x = use_hold ? (double)tasks[i].lock_hold_time : (double)tasks[i].num_lock_acquired;
+        sum += x;
+        sum_sq += x * x;
+    }
+    return sum_sq > 0 ? (sum * sum) / (n * sum_sq) : 1.0;
+}
+
+/*
+ * Largest relative gap between a fiber's share of the total hold time and the
+ * share its weight entitles it to (equal shares without --weights).
+ */
+static double share_error(const struct bench_config *config, const task_t *tasks, int n)
+{
+    double hold = 0, weight = 0, expected, err, max_err = 0;
+    unsigned int w;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        w = bench_weight(config, i);
+        hold += (double)tasks[i].lock_hold_time;
+        weight += w ? w : 1;
+    }
+    if (hold == 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        w = bench_weight(config, i);
+        expected = (w ? w : 1) / weight;
+        err = fabs((double)tasks[i].lock_hold_time / hold - expected) / expected;
+        if (err > max_err)
+            max_err = err;
+    }
+    return max_err;
+}
+
+struct bench_result {
+    uint64_t wall_ns;
+    ull acquires;
+    double throughput;            // acquires per second
+    double jain_hold;
+    double jain_acquires;
+    double share_error;
+    struct histogram wait;
+};
+
+
+/* ------------------------------------------------------------------ */
+/* Output                                                              */
+/* ------------------------------------------------------------------ */
+
+static void report_text(const struct bench_run *run, const task_t *tasks,
+                        const struct bench_result *result)
+{
+    FILE *out = run->config->out;
+    int i;
+
+    for (i = 0; i < run->nthreads && !run->config->quiet; i++) {
+        fprintf(out, "id %02d "
+                     "loop %10llu "
+                     "lock_acquires %8llu "
+                     "lock_hold(us) %10llu\n",
+                tasks[i].id,
+                tasks[i].loop_count_in_cs,
+                tasks[i].num_lock_acquired,
+                tasks[i].lock_hold_time);
+    }
+
+    fprintf(out, "run lock %s threads %d locks %d pattern %s duration(s) %llu cs(us) %s repeat %d "
+                 "acquires %llu "
+                 "throughput(ops/s) %.0f "
+                 "jain_hold %.4f "
+                 "jain_acquires %.4f "
+                 "share_error %.4f "
+                 "wait_p50(ns) %llu "
+                 "wait_p99(ns) %llu "
+                 "wait_p999(ns) %llu "
+                 "wait_max(ns) %llu\n",
+            run->ops->name, run->nthreads, run->nlocks, bench_pattern_names[run->config->pattern],
+            run->duration, run->cs_spec, run->repeat,
+            result->acquires,
+            result->throughput,
+            result->jain_hold,
+            result->jain_acquires,
+            result->share_error,
+            (ull)histogram_percentile(&result->wait, 50.0),
+            (ull)histogram_percentile(&result->wait, 99.0),
+            (ull)histogram_percentile(&result->wait, 99.9),
+            (ull)result->wait.max);
+}
+
+#define BENCH_CSV_HEADER                                                        \
+    "lock,threads,locks,pattern,duration_s,cs_us,think_us,weights,repeat,wall_ns,"      \
+    "acquires,throughput,jain_hold,jain_acquires,share_error,wait_p50_ns,"       \
+    "wait_p99_ns,wait_p999_ns,"  \
+    "wait_max_ns,fiber_acquires,fiber_hold_us,fiber_loops\n"
+
+/* Per-fiber columns are space-separated lists, fiber 0 first. */
+static void report_csv(const struct bench_run *run, const task_t *tasks,
+                       const struct bench_result *result)
+{
+    FILE *out = run->config->out;
+    int i;
+
+    fprintf(out, "%s,%d,%d,%s,%llu,\"%s\",\"%s\",\"%s\",%d,%llu,%llu,%.1f,%.6f,%.6f,%.6f,"
+                 "%llu,%llu,%llu,%llu,",
+            run->ops->name, run->nthreads, run->nlocks, bench_pattern_names[run->config->pattern],
+            run->duration,
+            run->cs_spec, run->config->think_spec, run->config->weights_spec, run->repeat,
+            (ull)result->wall_ns, result->acquires, result->throughput,
+            result->jain_hold, result->jain_acquires, result->share_error,
+            (ull)histogram_percentile(&result->wait, 50.0),
+            (ull)histogram_percentile(&result->wait, 99.0),
+            (ull)histogram_percentile(&result->wait, 99.9),
+            (ull)result->wait.max);
+    for (i = 0; i < run->nthreads; i++) {
+        fprintf(out, "%s%llu", i ? " " : "", tasks[i].num_lock_acquired);
+    }
+    fprintf(out, ",");
+    for (i = 0; i < run->nthreads; i++) {
+        fprintf(out, "%s%llu", i ? " " : "", tasks[i].lock_hold_time);
+    }
+    fprintf(out, ",");
+    for (i = 0; i < run->nthreads; i++) {
+        fprintf(out, "%s%llu", i ? " " : "", tasks[i].loop_count_in_cs);
+    }
+    fprintf(out, "\n");
+}
+
+/* One JSON object per line. */
+static void report_json(const struct bench_run *run, const task_t *tasks,
+                        const struct bench_result *result)
+{
+    FILE *out = run->config->out;
+    int i;
+
+    fprintf(out, "{\"lock\": \"%s\", \"threads\": %d, \"locks\": %d, \"pattern\": \"%s\", "
+                 "\"duration_s\": %llu, "
+                 "\"cs_us\": \"%s\", \"think_us\": \"%s\", \"weights\": \"%s\", \"repeat\": %d, "
+                 "\"wall_ns\": %llu, \"acquires\": %llu, \"throughput\": %.1f, \"jain_hold\": %.6f, "
+                 "\"jain_acquires\": %.6f, \"share_error\": %.6f, \"wait_ns\": {\"p50\": %llu, \"p99\": %llu, "
+                 "\"p999\": %llu, \"max\": %llu}, \"fibers\": [",
+            run->ops->name, run->nthreads, run->nlocks, bench_pattern_names[run->config->pattern],
+            run->duration, run->cs_spec, run->config->think_spec, run->config->weights_spec,
+            run->repeat, (ull)result->wall_ns,
+            result->acquires, result->throughput, result->jain_hold, result->jain_acquires,
+            result->share_error,
+            (ull)histogram_percentile(&result->wait, 50.0),
+            (ull)histogram_percentile(&result->wait, 99.0),
+            (ull)histogram_percentile(&result->wait, 99.9),
+            (ull)result->wait.max);
+    for (i = 0; i < run->nthreads; i++) {
+        fprintf(out, "%s{\"id\": %d, \"acquires\": %llu, \"hold_us\": %llu, \"loops\": %llu}",
+                i ? ", " : "", tasks[i].id, tasks[i].num_lock_acquired,
+                tasks[i].lock_hold_time, tasks[i].loop_count_in_cs);
+    }
+    fprintf(out, "]}\n");
+}
+
+
+/* ------------------------------------------------------------------ */
+/* Running                                                             */
+/* ------------------------------------------------------------------ */
+
+static void *alloc_lock(const struct bench_lock_ops *ops)
+{
+    size_t size = (ops->size + FAIRLOCK_CACHELINE - 1) & ~(size_t)(FAIRLOCK_CACHELINE - 1);
+    void *lock = aligned_alloc(FAIRLOCK_CACHELINE, size);
+
+    if (!lock) {
+        fprintf(stderr, "Error: Unable to allocate %s\n", ops->name);
+        exit(EXIT_FAILURE);
+    }
+    return lock;
+}
+
+/* Domain totals for the run, and the largest share of them charged to one fiber. */
+static void domain_report(FILE *out, struct lock_domain *domain)
+{
+    struct lock_domain_stats stats;
+
+    lock_domain_get_stats(domain, &stats);
+    fprintf(out, "domain_hold(us) %10llu "
+                 "charges %10llu "
+                 "ban_waits %10llu "
+                 "fibers %4u "
+                 "max_fiber_share %.4f\n",
+                 (ull)(stats.hold_ns / NSEC_PER_USEC),
+                 (ull)stats.charges,
+                 (ull)stats.ban_waits,
+                 stats.nfibers,
+                 stats.hold_ns ? (double)stats.max_fiber_hold_ns / stats.hold_ns : 0.0);
+}
+
+static void run_once(struct bench_run *run, struct bench_result *result)
+{
+    const struct bench_config *config = run->config;
+    const struct bench_lock_ops *ops = run->ops;
+    int nthreads = run->nthreads;
+    struct lock_domain *domain = NULL;
+    task_t *tasks;
+    fiber_t **fibers;
+    uint64_t start_time;
+    int i;
+
+    run->nlocks = config->nlocks;
+    run->locks = calloc(config->nlocks, sizeof(*run->locks));
+    tasks = calloc(nthreads, sizeof(*tasks));
+    fibers = calloc(nthreads, sizeof(*fibers));
+    if (!run->locks || !tasks || !fibers) {
+        fprintf(stderr, "Error: Unable to allocate benchmark state\n");
+        exit(EXIT_FAILURE);
+    }
+    if (config->domain && ops->set_domain) {
+        domain = aligned_alloc(LOCK_DOMAIN_CACHELINE, sizeof(*domain));
+        if (!domain) {
+            fprintf(stderr, "Error: Unable to allocate lock domain\n");
+            exit(EXIT_FAILURE);
+        }
+        lock_domain_init(domain);
+    }
+    for (i = 0; i < config->nlocks; i++) {
+        run->locks[i] = alloc_lock(ops);
+        ops->init(run->locks[i]);
+        if (domain)
+            ops->set_domain(run->locks[i], domain);
+    }
+
+    start_time = now_ns();
+
+    for (i = 0; i < nthreads; i++) {
+        tasks[i].id = i;
+        tasks[i].run = run;
+        tasks[i].start_time = start_time;
+        tasks[i].duration = run->duration;
+        tasks[i].rng = ((uint64_t)run->repeat << 32 | (uint64_t)i) * 0x9E3779B97F4A7C15ULL + 1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        fibers[i] = fiber_create(BENCH_FIBER_STACK, &run_func, (void*)&tasks[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        fiber_join(fibers[i], NULL);
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->wall_ns = now_ns() - start_time;
+    for (i = 0; i < nthreads; i++) {
+        result->acquires += tasks[i].num_lock_acquired;
+        histogram_merge(&result->wait, &tasks[i].wait);
+    }
+    result->throughput = (double)result->acquires * NSEC_PER_SEC / (double)result->wall_ns;
+    result->jain_hold = jain_index(tasks, nthreads, 1);
+    result->jain_acquires = jain_index(tasks, nthreads, 0);
+    result->share_error = share_error(config, tasks, nthreads);
+
+    switch (config->format) {
+    case BENCH_CSV:
+        report_csv(run, tasks, result);
+        break;
+    case BENCH_JSON:
+        report_json(run, tasks, result);
+        break;
+    default:
+        report_text(run, tasks, result);
+        if (ops->report)
+            ops->report(config->out, run->locks[0]);
+        if (domain)
+            domain_report(config->out, domain);
+        ban_queue_report(config->out);
+        break;
+    }
+    fflush(config->out);
+    LOCKSTAT_ONLY(lockstat_dump();)
+
+    for (i = 0; i < config->nlocks; i++) {
+        ops->destroy(run->locks[i]);
+        free(run->locks[i]);
+    }
+    free(run->locks);
+    if (domain) {
+        lock_domain_destroy(domain);
+        free(domain);
+    }
+    free(tasks);
+    free(fibers);
+}
+
+static void run_config(struct bench_run *run)
+{
+    const struct bench_config *config = run->config;
+    struct bench_result *result;
+    double tput = 0, tput_sq = 0, jain_hold = 0, jain_acquires = 0, share_err = 0;
+    double mean, stddev;
+    int r;
+
+    /* Big histogram inside; keep it off the stack. */
+    result = malloc(sizeof(*result));
+    if (!result) {
+        fprintf(stderr, "Error: Unable to allocate benchmark state\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (r = 0; r < config->repeats; r++) {
+        run->repeat = r;
+        run_once(run, result);
+        tput += result->throughput;
+        tput_sq += result->throughput * result->throughput;
+        jain_hold += result->jain_hold;
+        jain_acquires += result->jain_acquires;
+        share_err += result->share_error;
+    }
+    free(result);
+
+    if (config->format != BENCH_TEXT)
+        return;
+    mean = tput / config->repeats;
+    stddev = sqrt(fmax(tput_sq / config->repeats - mean * mean, 0.0));
+    fprintf(config->out, "summary lock %s threads %d locks %d duration(s) %llu cs(us) %s repeats %d "
+                         "throughput(ops/s) %.0f "
+                         "stddev %.0f "
+                         "jain_hold %.4f "
+                         "jain_acquires %.4f "
+                         "share_error %.4f\n",
+            run->ops->name, run->nthreads, config->nlocks, run->duration, run->cs_spec, config->repeats,
+            mean, stddev,
+            jain_hold / config->repeats,
+            jain_acquires / config->repeats,
+            share_err / config->repeats);
+}
+
+/* Run every point of the sweep, all in this process. */
+static void run_sweep(const struct bench_config *config)
+{
+    struct bench_run run;
+    struct dist ratio_cs;
+    ull ratio_values[2];
+    char ratio_spec[64];
+    int l, t, d, c;
+    int ncs = config->ncs_ratios > 0 ? config->ncs_ratios : 1;
+
+    if (config->format == BENCH_CSV)
+        fprintf(config->out, BENCH_CSV_HEADER);
+
+    memset(&run, 0, sizeof(run));
+    run.config = config;
+    for (l = 0; l < config->nlock_types; l++) {
+        run.ops = config->lock_types[l];
+        for (t = 0; t < config->nthread_counts; t++) {
+            run.nthreads = config->threads[t];
+            for (d = 0; d < config->ndurations; d++) {
+                run.duration = config->durations[d];
+                for (c = 0; c < ncs; c++) {
+                    if (config->ncs_ratios > 0) {
+                        ratio_values[0] = config->cs.a;
+                        ratio_values[1] = config->cs.a * config->cs_ratios[c];
+                        memset(&ratio_cs, 0, sizeof(ratio_cs));
+                        ratio_cs.kind = DIST_LIST;
+                        ratio_cs.values = ratio_values;
+                        ratio_cs.nvalues = 2;
+                        snprintf(ratio_spec, sizeof(ratio_spec), "%llu,%llu",
+                                 ratio_values[0], ratio_values[1]);
+                        run.cs = &ratio_cs;
+                        run.cs_spec = ratio_spec;
+                    } else {
+                        run.cs = &config->cs;
+                        run.cs_spec = config->cs_spec;
+                    }
+                    run_config(&run);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config config;
+    int workers = 0;
+    int t;
+
+    if (parse_args(argc, argv, &config) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LOCKSTAT_ONLY(lockstat_init();)
+
+    for (t = 0; t < config.nthread_counts; t++) {
+        if (config.threads[t] > workers)
+            workers = config.threads[t];
+    }
+    /* Room for every fiber in each sched_lock's fiber table. */
+    while (sched_fiber_slots < 2 * (unsigned int)workers)
+        sched_fiber_slots *= 2;
+    if (config.workers)
+        workers = config.workers;
+    fiber_manager_init(workers);
+
+    run_sweep(&config);
+
+    if (config.out != stdout)
+        fclose(config.out);
+    // fiber_manager_print_stats();
+    ban_queue_shutdown();
+    fiber_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Checks the statuses of sched_lock_tryacquire() and
+ * sched_lock_acquire_until() against a slice held by another fiber and
+ * against the caller's own ban.
+ *
+ * usage: tryacquire_check
+ *
+ * A holder fiber takes the lock and keeps its slice while a probe fiber
+ * expects SCHED_LOCK_BUSY from tryacquire and SCHED_LOCK_TIMEDOUT from a
+ * short deadline. The holder then runs its slice out, which bans it, and
+ * expects SCHED_LOCK_BANNED for a deadline that falls before the ban ends.
+ * Exits non-zero if any call returns another status.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "fiber_manager.h"
+#include "schedlock.h"
+
+#define PROBE_WAIT_NS (10 * NSEC_PER_USEC)   // well inside the holder's slice
+#define BANNED_WAIT_NS NSEC_PER_USEC          // well before the holder's ban ends
+
+static struct sched_lock lock;
+static atomic_int held;          // the holder owns the slice
+static atomic_int probe_done;    // the probe has made its calls
+static atomic_int holder_done;   // the holder has made its calls
+static int failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "Error: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+static void wait_for(atomic_int *flag)
+{
+    while (!atomic_load(flag))
+        fiber_yield();
+}
+
+static void *holder(void *param)
+{
+    (void)param;
+
+    CHECK(sched_lock_tryacquire(&lock) == SCHED_LOCK_OK);
+    atomic_store(&held, 1);
+    wait_for(&probe_done);
+
+    /* Run the slice out so the release bans us; the probe still counts as a competitor. */
+    while (now_ns() <= atomic_load(&lock.slice_end_time)) {
+    }
+    sched_lock_release(&lock);
+    CHECK(sched_lock_acquire_until(&lock, now_ns() + BANNED_WAIT_NS) == SCHED_LOCK_BANNED);
+
+    /* Without a deadline the ban is waited out. */
+    CHECK(sched_lock_acquire_until(&lock, UINT64_MAX) == SCHED_LOCK_OK);
+    sched_lock_release(&lock);
+
+    atomic_store(&holder_done, 1);
+    return NULL;
+}
+
+static void *probe(void *param)
+{
+    (void)param;
+
+    wait_for(&held);
+    CHECK(sched_lock_tryacquire(&lock) == SCHED_LOCK_BUSY);
+    CHECK(sched_lock_acquire_until(&lock, now_ns() + PROBE_WAIT_NS) == SCHED_LOCK_TIMEDOUT);
+    atomic_store(&probe_done, 1);
+
+    /* Stay alive until the holder has been banned. */
+    wait_for(&holder_done);
+    return NULL;
+}
+
+int main(void)
+{
+    fiber_t *fibers[2];
+
+    timing_calibrate();
+    fiber_manager_init(1);
+    sched_lock_init(&lock);
+
+    fibers[0] = fiber_create(10240, holder, NULL);
+    fibers[1] = fiber_create(10240, probe, NULL);
+    fiber_join(fibers[0], NULL);
+    fiber_join(fibers[1], NULL);
+
+    sched_lock_destroy(&lock);
+
+    if (failures) {
+        fprintf(stderr, "Error: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("tryacquire_check: ok\n");
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Uncontended fairlock microbenchmark: cost of a fair_lock/fair_unlock pair
+ * when a single fiber is the only user of the lock, next to a plain
+ * test-and-set spinlock pair as the floor.
+ *
+ * usage: uncontended_bench [pairs] [max cycles per pair]
+ *
+ * Exits non-zero if a fairlock pair costs more than the given number of
+ * cycles (default UNCONTENDED_MAX_CYCLES), so it can guard the fast path.
+ * Cycles are TSC cycles where the TSC clock is in use, otherwise they are
+ * derived from ns and CYCLE_PER_US.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "fiber_manager.h"
+#include "fairlock.h"
+#include "timing.h"
+
+#ifndef UNCONTENDED_MAX_CYCLES
+#define UNCONTENDED_MAX_CYCLES 100
+#endif
+
+struct bench_args {
+    size_t pairs;
+    double spin_cycles;
+    double fair_cycles;
+};
+
+static inline uint64_t cycles(void)
+{
+#ifdef TIMING_USE_TSC
+    return rdtsc();
+#elif defined(CYCLE_PER_US)
+    return now_ns() * CYCLE_PER_US / NSEC_PER_USEC;
+#else
+    return now_ns();
+#endif
+}
+
+static double bench_spinlock(size_t pairs)
+{
+    atomic_flag flag = ATOMIC_FLAG_INIT;
+    uint64_t start, end;
+    size_t i;
+
+    start = cycles();
+    for (i = 0; i < pairs; i++) {
+        while (atomic_flag_test_and_set_explicit(&flag, memory_order_acquire)) {
+        }
+        atomic_flag_clear_explicit(&flag, memory_order_release);
+    }
+    end = cycles();
+    return (double)(end - start) / pairs;
+}
+
+static double bench_fairlock(size_t pairs)
+{
+    struct fairlock *lock;
+    uint64_t start, end;
+    size_t i;
+
+    lock = aligned_alloc(FAIRLOCK_CACHELINE, sizeof(*lock));
+    if (!lock) {
+        fprintf(stderr, "Error: Unable to allocate fairlock\n");
+        exit(EXIT_FAILURE);
+    }
+    fairlock_init(lock);
+
+    /* The first acquisition creates the waiter; leave it out. */
+    fair_lock(lock, 0);
+    fair_unlock(lock);
+
+    start = cycles();
+    for (i = 0; i < pairs; i++) {
+        fair_lock(lock, 0);
+        fair_unlock(lock);
+    }
+    end = cycles();
+
+    fairlock_destroy(lock);
+    free(lock);
+    return (double)(end - start) / pairs;
+}
+
+static void *run_bench(void *param)
+{
+    struct bench_args *args = param;
+
+    args->spin_cycles = bench_spinlock(args->pairs);
+    args->fair_cycles = bench_fairlock(args->pairs);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_args args;
+    double max_cycles = argc > 2 ? strtod(argv[2], NULL) : UNCONTENDED_MAX_CYCLES;
+    fiber_t *fiber;
+
+    args.pairs = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    if (args.pairs == 0 || max_cycles <= 0) {
+        printf("usage: %s [pairs] [max cycles per pair]\n", argv[0]);
+        return 1;
+    }
+
+    timing_calibrate();
+    fiber_manager_init(1);
+    fiber = fiber_create(10240, &run_bench, &args);
+    fiber_join(fiber, NULL);
+
+    printf("%12s %16s\n", "lock", "cycles/pair");
+    printf("%12s %16.1f\n", "spinlock", args.spin_cycles);
+    printf("%12s %16.1f\n", "fairlock", args.fair_cycles);
+
+    if (args.fair_cycles > max_cycles) {
+        fprintf(stderr, "Error: fairlock pair took %.1f cycles, limit %.1f\n",
+                args.fair_cycles, max_cycles);
+        return 1;
+    }
+    return 0;
+}
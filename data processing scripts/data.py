@@ -1,20 +1,41 @@
 import matplotlib.pyplot as plt
 import numpy as np
 
+import csv
+import sys
+
+# Results from one subversion_demo sweep, e.g.
+#   ./bin/subversion_demo -l mutex -t 2 -d 5 -c 1 -R 1,2,3,5,10 -f csv -o results.csv
+# If the file holds several locks or repeats, pick one with LOCK below; repeats are averaged.
+RESULTS = sys.argv[1] if len(sys.argv) > 1 else 'results.csv'
+LOCK = sys.argv[2] if len(sys.argv) > 2 else None
+
+by_ratio = {}
+with open(RESULTS) as f:
+    for row in csv.DictReader(f):
+        if LOCK and row['lock'] != LOCK:
+            continue
+        cs = [int(v) for v in row['cs_us'].split(',')]
+        r = cs[1] // cs[0] if len(cs) > 1 and cs[0] else 1
+        by_ratio.setdefault(r, []).append(row)
+
+def per_fiber(column, fid):
+    return [np.mean([int(row[column].split()[fid]) for row in by_ratio[r]]) for r in ratios]
+
 # Critical-section ratios
-ratios = [1, 2, 3, 5, 10]
+ratios = sorted(by_ratio)
 
 # --------------------- Loop Counts --------------------- #
-loop_id00 = [213210165, 202178527, 209902135, 219976974, 226743221]
-loop_id01 = [210984911, 246575002, 252697022, 257537536, 258866192]
+loop_id00 = per_fiber('fiber_loops', 0)
+loop_id01 = per_fiber('fiber_loops', 1)
 
 # ------------------ Lock Acquires ---------------------- #
-acq_id00  = [4822807,   4841693,   4842466,   4825796,   4874298]
-acq_id01  = [4822788,   2432593,   1609995,   969544,    486718]
+acq_id00  = per_fiber('fiber_acquires', 0)
+acq_id01  = per_fiber('fiber_acquires', 1)
 
 # ------------------- Lock Hold (us) -------------------- #
-hold_id00 = [4961593,   4948599,   4955282,   4959475,   4973242]
-hold_id01 = [4961387,   4994102,   4995550,   4997435,   4998862]
+hold_id00 = per_fiber('fiber_hold_us', 0)
+hold_id01 = per_fiber('fiber_hold_us', 1)
 
 # Create a figure with 3 subplots, side by side
 fig, axs = plt.subplots(1, 3, figsize=(15, 5))
@@ -1,71 +1,60 @@
 #/usr/bin/python3
+import csv
+import io
 import subprocess
 import matplotlib.pyplot as plt
 
-def run_subversion_demo_with_timeout(nthreads=3, duration=2, cs=(100,1,10), timeout_sec=5):
+BINARY = "./bin/subversion_demo"
+
+
+def run_sweep(locks=("mutex",), threads=(2,), durations=(5,), cs=1, cs_ratios=None,
+              repeats=1, extra_args=()):
     """
-    Runs the subversion_demo program with the given arguments and enforces a timeout.
-    If the program does not finish within 'timeout_sec' seconds, it is killed, and
-    any partial output captured so far is returned and parsed.
-
-    :param nthreads:    Number of threads (example default: 3)
-    :param param2:      Example parameter (example default: 2)
-    :param param3:      Example parameter (example default: 1)
-    :param param4:      Example parameter (example default: 1000)
-    :param param5:      Example parameter (example default: 1)
-    :param timeout_sec: Kill the process after this many seconds (default: 12)
-    :return: A list of dictionaries with fields:
-             {
-               'thread_id': <string>,
-               'loop_no': <int>,
-               'lock_acquires': <int>,
-               'lock_hold_us': <int>
-             }
+    Runs the whole sweep (locks x threads x durations x cs_ratios x repeats)
+    in a single subversion_demo process and returns its CSV records.
+
+    :param locks:      Lock names, see `subversion_demo --help`
+    :param threads:    Thread counts to sweep
+    :param durations:  Run lengths in seconds
+    :param cs:         Critical section in us: a number, or a string such as
+                       "1,10" (per thread) or "uniform:1-50"
+    :param cs_ratios:  With a fixed cs, sweep odd:even critical-section ratios
+    :param repeats:    Runs per configuration
+    :param extra_args: Any further subversion_demo options
+    :return: A list of dictionaries, one per run, with the CSV columns.
+             'fiber_acquires', 'fiber_hold_us' and 'fiber_loops' are lists
+             indexed by fiber id; numeric columns are converted.
     """
-    
     cmd = [
-        "./bin/subversion_demo",
-        str(nthreads),
-        str(duration),
+        BINARY,
+        "--format", "csv",
+        "--lock", ",".join(locks),
+        "--threads", ",".join(str(t) for t in threads),
+        "--duration", ",".join(str(d) for d in durations),
+        "--cs", str(cs),
+        "--repeat", str(repeats),
     ]
-    
-    for i in cs:
-        cmd.append(str(i))
-
-    try:
-        result = subprocess.run(
-            cmd, 
-            capture_output=True, 
-            text=True, 
-            timeout=timeout_sec
-        )
-        output = result.stdout
-    except subprocess.TimeoutExpired as e:
-        output = e.output or ""
-
-    results = []
-    for line in output.splitlines():
-        line = line.strip()
-        # Expect lines of the form:
-        # "id 00 loop 26460939 lock_acquires 662235 lock_hold(us) 665367"
-        if line.startswith("id "):
-            parts = line.split()
-            if len(parts) == 8:
-                # parts: ["id", thread_id, "loop", loop_no, "lock_acquires",
-                #         lock_acquires, "lock_hold(us)", lock_hold_us]
-                thread_id     = parts[1]
-                loop_no       = int(parts[3])
-                lock_acquires = int(parts[5])
-                lock_hold_us  = int(parts[7])
-                
-                results.append({
-                    "thread_id": thread_id,
-                    "loop_no": loop_no,
-                    "lock_acquires": lock_acquires,
-                    "lock_hold_us": lock_hold_us
-                })
+    if cs_ratios:
+        cmd += ["--cs-ratio", ",".join(str(r) for r in cs_ratios)]
+    cmd += list(extra_args)
+
+    result = subprocess.run(cmd, capture_output=True, text=True, check=True)
+
+    records = []
+    for row in csv.DictReader(io.StringIO(result.stdout)):
+        for key in ("threads", "locks", "duration_s", "repeat", "wall_ns", "acquires",
+                    "wait_p50_ns", "wait_p99_ns", "wait_p999_ns", "wait_max_ns"):
+            row[key] = int(row[key])
+        for key in ("throughput", "jain_hold", "jain_acquires", "share_error"):
+            row[key] = float(row[key])
+        for key in ("fiber_acquires", "fiber_hold_us", "fiber_loops"):
+            row[key] = [int(v) for v in row[key].split()]
+        records.append(row)
+    return records
 
-    return results
+
+def ratio(a, b):
+    return a / b if b != 0 else 0
 
 
 def duration_experiments():
@@ -75,65 +64,27 @@ def duration_experiments():
     Then plots these ratios vs. the duration using matplotlib.
 
     :return: A dictionary mapping duration -> {
-        "ratio_lock_hold_us": float or None,
-        "ratio_lock_acquires": float or None,
-        "ratio_loop_no": float or None
+        "ratio_lock_hold_us": float,
+        "ratio_lock_acquires": float,
+        "ratio_loop_no": float
     }
     """
-    # durations = [1, 2, 3, 4, 5, 10, 100, 1000]
     durations = [1, 2, 5, 10, 20]
 
+    records = run_sweep(threads=(2,), durations=durations, cs="1,10")
+
     results = {}
-    ratio_hold_list = []
-    ratio_acquires_list = []
-    ratio_loop_list = []
-
-    for dur in durations:
-        run_data = run_subversion_demo_with_timeout(
-            nthreads=2,
-            duration=dur,
-            cs=(1, 10),
-            timeout_sec=30
-        )
-        print(" Duration (s):" , dur)
-        for record in run_data:
-            print(record)
-
-        t0 = None
-        t1 = None
-        for record in run_data:
-            if record["thread_id"] == "00":
-                t0 = record
-            elif record["thread_id"] == "01":
-                t1 = record
-
-        if t0 and t1:
-            ratio_lock_hold_us = (
-                t0["lock_hold_us"] / t1["lock_hold_us"]
-                if t1["lock_hold_us"] != 0 else None
-            )
-            ratio_lock_acquires = (
-                t0["lock_acquires"] / t1["lock_acquires"]
-                if t1["lock_acquires"] != 0 else None
-            )
-            ratio_loop_no = (
-                t0["loop_no"] / t1["loop_no"]
-                if t1["loop_no"] != 0 else None
-            )
-        else:
-            ratio_lock_hold_us = None
-            ratio_lock_acquires = None
-            ratio_loop_no = None
-
-        results[dur] = {
-            "ratio_lock_hold_us": ratio_lock_hold_us,
-            "ratio_lock_acquires": ratio_lock_acquires,
-            "ratio_loop_no": ratio_loop_no
+    for record in records:
+        print(record)
+        results[record["duration_s"]] = {
+            "ratio_lock_hold_us": ratio(*record["fiber_hold_us"][:2]),
+            "ratio_lock_acquires": ratio(*record["fiber_acquires"][:2]),
+            "ratio_loop_no": ratio(*record["fiber_loops"][:2]),
         }
 
-        ratio_hold_list.append(ratio_lock_hold_us if ratio_lock_hold_us else 0)
-        ratio_acquires_list.append(ratio_lock_acquires if ratio_lock_acquires else 0)
-        ratio_loop_list.append(ratio_loop_no if ratio_loop_no else 0)
+    ratio_hold_list = [results[d]["ratio_lock_hold_us"] for d in durations]
+    ratio_acquires_list = [results[d]["ratio_lock_acquires"] for d in durations]
+    ratio_loop_list = [results[d]["ratio_loop_no"] for d in durations]
 
     # Create a figure with 3 subplots, side by side
     fig, axs = plt.subplots(1, 3, figsize=(15, 4))
@@ -157,18 +108,17 @@ def duration_experiments():
     axs[2].set_title("Loop No. Ratio vs. Duration")
 
     plt.tight_layout()
-    
+
     # Save the plot to a file instead of showing it
     plt.savefig("experiment_results.png", dpi=150)
     plt.close(fig)  # Close the figure to free memory
 
     return results
-    
+
 
 if __name__ == "__main__":
     # Example usage:
-    # data = run_subversion_demo_with_timeout()
-    # print("got data", data)
-    # for record in data:
-    #     print(record)
-    print( duration_experiments())
+    # for record in run_sweep(locks=("mutex", "fairlock", "schedlock"), threads=(2, 4, 8),
+    #                         cs=1, cs_ratios=(1, 2, 3, 5, 10), durations=(5,)):
+    #     print(record["lock"], record["threads"], record["cs_us"], record["jain_hold"])
+    print(duration_experiments())
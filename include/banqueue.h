@@ -0,0 +1,74 @@
+#ifndef _BAN_QUEUE_H_
+#define _BAN_QUEUE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "timing.h"
+
+/*
+ * Banned fibers wait off the run queue. A fiber with at least
+ * BAN_QUEUE_PARK_MIN_NS of ban left parks on its own condition variable and
+ * is filed in a process-wide min-heap keyed by banned_until, instead of
+ * yielding or sleeping in a loop. Expired entries are woken by whichever
+ * comes first:
+ *
+ *  - a lock handoff (fairlock_pass(), sched_lock_pass(), sched_rwlock
+ *    release) calling ban_queue_poll(), a single load while nobody is banned;
+ *  - a fiber scheduler calling ban_queue_poll() between fibers, using
+ *    ban_queue_next_expiry() to decide how long it may idle;
+ *  - the ban timer fiber, started on first use, which sleeps until the
+ *    earliest expiry but never longer than BAN_QUEUE_TICK_NS, so a ban filed
+ *    while it sleeps is woken at most that late.
+ *
+ * Shorter bans are waited out with fiber_yield().
+ *
+ * The timer fiber is counted by get_fiber_count() but never competes for a
+ * lock; locks that scale bans by the fiber count leave it out with
+ * ban_queue_fibers().
+ */
+#ifndef BAN_QUEUE_PARK_MIN_NS
+#define BAN_QUEUE_PARK_MIN_NS (5 * NSEC_PER_USEC)
+#endif
+#ifndef BAN_QUEUE_TICK_NS
+#define BAN_QUEUE_TICK_NS (100 * NSEC_PER_USEC)
+#endif
+
+struct ban_queue_stats {
+    uint64_t parked;           // bans waited out in the heap
+    uint64_t woken_by_poll;    // of those, woken at a handoff or by the scheduler
+    uint64_t woken_by_timer;   // of those, woken by the ban timer fiber
+    uint64_t late_ns;          // total wake-up delay past banned_until
+};
+
+/* Earliest banned_until in the heap, UINT64_MAX while it is empty. */
+extern _Atomic uint64_t ban_queue_next;
+/* Fibers the ban queue runs itself: 1 while the timer fiber exists. */
+extern atomic_int ban_queue_nfibers;
+
+void ban_queue_wait(uint64_t banned_until);
+void ban_queue_drain(void);
+void ban_queue_get_stats(struct ban_queue_stats *out);
+void ban_queue_shutdown(void);
+
+static inline int ban_queue_fibers(void)
+{
+    return atomic_load_explicit(&ban_queue_nfibers, memory_order_relaxed);
+}
+
+static inline uint64_t ban_queue_next_expiry(void)
+{
+    return atomic_load_explicit(&ban_queue_next, memory_order_acquire);
+}
+
+/* Wake fibers whose ban has run out. */
+static inline void ban_queue_poll(void)
+{
+    uint64_t next = atomic_load_explicit(&ban_queue_next, memory_order_relaxed);
+
+    if (__builtin_expect(next == UINT64_MAX, 1))
+        return;
+    if (now_ns() >= next)
+        ban_queue_drain();
+}
+
+#endif /* _BAN_QUEUE_H_ */
@@ -2,25 +2,327 @@
 #define __LINUX_FAIRLOCK_H
 
 #include <stdatomic.h>
+#include <stdint.h>
 #include "hashmap.h"
 #include "list.h"
+#include "fiber_mutex.h"
+#include "fiber_cond.h"
+#include "timing.h"
+#include "lockstat.h"
+#include "banqueue.h"
+#include "lockdomain.h"
+
+#define FAIRLOCK_CACHELINE 64
+
+/*
+ * Waiters spin for FAIRLOCK_SPIN_LIMIT polls and then park on the fiber
+ * scheduler until their ticket comes up. Tickets are spread over
+ * FAIRLOCK_PARK_SLOTS (a power of two) wait slots so a handoff only wakes
+ * fibers whose ticket maps to the same slot.
+ *
+ * In FAIRLOCK_TICKET mode every waiter polls the shared now_serving. In
+ * FAIRLOCK_QUEUE mode each waiter polls the turn field of its own
+ * cache-line-sized slot (an array-based queue lock), so a handoff
+ * invalidates one waiter's line instead of every waiter's.
+ */
+#ifndef FAIRLOCK_SPIN_LIMIT
+#define FAIRLOCK_SPIN_LIMIT 1024
+#endif
+#ifndef FAIRLOCK_PARK_SLOTS
+#define FAIRLOCK_PARK_SLOTS 64
+#endif
+
+_Static_assert((FAIRLOCK_PARK_SLOTS & (FAIRLOCK_PARK_SLOTS - 1)) == 0,
+               "FAIRLOCK_PARK_SLOTS must be a power of two");
+
+enum fairlock_mode {
+    FAIRLOCK_TICKET = 0,
+    FAIRLOCK_QUEUE,
+};
+
+/* Initial size of the fid lookup table; it grows with the number of fibers. */
+#ifndef FAIRLOCK_LOOKUP_BITS
+#define FAIRLOCK_LOOKUP_BITS 9
+#endif
+
+/*
+ * Waiters are carved out of a per-lock pool sized at init and recycled through
+ * a free list, so acquire/release never touch the heap once every fiber has
+ * been seen. A full pool falls back to malloc.
+ */
+#ifndef FAIRLOCK_POOL_CAPACITY
+#define FAIRLOCK_POOL_CAPACITY 256
+#endif
+
+/*
+ * lock->waiters is kept in least-recently-acquired order. Each unlock looks
+ * at no more than FAIRLOCK_REAP_BUDGET waiters at the head and drops those
+ * idle for longer than the lock's inactive threshold.
+ */
+#ifndef FAIRLOCK_REAP_BUDGET
+#define FAIRLOCK_REAP_BUDGET 2
+#endif
+#ifndef FAIRLOCK_INACTIVE_THRESHOLD_NS
+#define FAIRLOCK_INACTIVE_THRESHOLD_NS 1000000000ULL // 1 second
+#endif
+
+/*
+ * Weighted fair share: each fiber has a weight (FAIRLOCK_DEFAULT_WEIGHT unless
+ * set with fair_lock_weighted() or fairlock_set_weight()). A critical section
+ * of cs_length bans its fiber for cs_length * total_weight / weight, where
+ * total_weight sums the weights of the fibers the lock is tracking, so each
+ * fiber converges on weight / total_weight of the lock's hold time. With equal
+ * weights the ban is cs_length * num_threads, as without weights.
+ */
+#define FAIRLOCK_DEFAULT_WEIGHT 1024
+#define FAIRLOCK_MAX_WEIGHT     (1U << 20)
+
+/*
+ * Flat combining: fair_combine() runs fn(arg) as fid's critical section, but
+ * rather than every submitter taking the lock in turn, whichever fiber gets
+ * the lock runs up to FAIRLOCK_COMBINE_BATCH queued sections back to back.
+ * Each section is charged to its submitter's waiter (hold time, ban, weight)
+ * exactly as if that fiber had held the lock, and a submitter that is still
+ * banned is skipped until a later batch. Skipped sections wait on a list of
+ * their own and go first in the next batch, so they keep their place ahead
+ * of sections submitted after them. fn runs on the combining fiber, so it
+ * must not block or depend on which fiber runs it.
+ */
+#ifndef FAIRLOCK_COMBINE_BATCH
+#define FAIRLOCK_COMBINE_BATCH 64
+#endif
+/* Yields a submitter waits through before it queues for a ticket itself. */
+#ifndef FAIRLOCK_COMBINE_YIELDS
+#define FAIRLOCK_COMBINE_YIELDS 64
+#endif
+
+/*
+ * Each fiber's ban deadline is also published in a direct-mapped table of
+ * FAIRLOCK_BAN_SLOTS entries (a power of two) indexed by fid, which is read
+ * without the ticket. A banned fiber sits out its ban before queuing rather
+ * than taking a ticket only to hand it straight back. Only the ticket holder
+ * writes the table, under a per-slot sequence count. Fibers whose fids share
+ * a slot evict each other; one without an entry is caught by the check made
+ * under the ticket, as before.
+ */
+#ifndef FAIRLOCK_BAN_SLOTS
+#define FAIRLOCK_BAN_SLOTS 256
+#endif
+
+_Static_assert((FAIRLOCK_BAN_SLOTS & (FAIRLOCK_BAN_SLOTS - 1)) == 0,
+               "FAIRLOCK_BAN_SLOTS must be a power of two");
 
 struct fairlock_waiter;
 
+/* A queued fair_combine() section; lives on the submitter's stack. */
+struct fairlock_request {
+    void (*fn)(void *arg);
+    void *arg;
+    int fid;
+    unsigned int weight;             // as for fair_lock_weighted(); 0 keeps the current one
+    uint64_t submitted;              // now_ns() at submission
+    uintptr_t fiber;                 // submitting fiber, for the lock's domain
+    _Atomic uint64_t banned_until;   // set when a combiner skipped it for a ban
+    atomic_int done;
+    struct fairlock_request *next;
+};
+
+struct fairlock_park_slot {
+    _Alignas(FAIRLOCK_CACHELINE) atomic_uint turn; // queue mode: ticket granted through this slot
+    atomic_int parked;
+    fiber_mutex_t mutex;
+    fiber_cond_t cond;
+};
+
+struct fairlock_ban_slot {
+    atomic_uint seq;                 // odd while the holder rewrites the slot
+    atomic_int fid;
+    _Atomic uint64_t banned_until;   // ns, now_ns() clock
+};
+
 struct fairlock {
-    // DECLARE_HASHTABLE(waiters_lookup, 8);
-    struct hlist_head waiters_lookup[(1 << 8)]; // there will be 8 bits so 256 buckets
-    struct list_head waiters;
-    atomic_int num_threads;
-    atomic_int next_ticket;
-    atomic_int now_serving;
+    /* Hot handoff fields each get their own cache line. */
+    _Alignas(FAIRLOCK_CACHELINE) atomic_int next_ticket;
+    _Alignas(FAIRLOCK_CACHELINE) atomic_int now_serving;
+    _Alignas(FAIRLOCK_CACHELINE) _Atomic(struct fairlock_request *) combine_head; // newest first
+    /* Everything below is only touched by the ticket holder. */
+    _Alignas(FAIRLOCK_CACHELINE) atomic_int num_threads;
+    struct lock_domain *domain;      // NULL unless set before the lock is shared
+    uint64_t total_weight;
+    unsigned int cond_parked;        // tracked fibers parked in fair_cond_wait()
+    uint64_t cond_weight;            // and their total weight
+    int mode;
     struct fairlock_waiter *holder;
+    struct fairlock_request *combine_deferred;   // skipped sections, oldest first
+    struct fairlock_request *combine_deferred_last;
+    struct hashmap waiters_lookup; // fid -> struct fairlock_waiter *
+    struct list_head waiters;
+    struct fairlock_waiter *pool;
+    unsigned int pool_capacity;
+    struct list_head free_waiters;
+    uint64_t inactive_threshold_ns;
+    struct fairlock_park_slot park[FAIRLOCK_PARK_SLOTS];
+    /* Read by any fiber, written by the ticket holder. */
+    _Alignas(FAIRLOCK_CACHELINE) struct fairlock_ban_slot bans[FAIRLOCK_BAN_SLOTS];
+    LOCKSTAT_ONLY(struct lockstat stats;)
 };
 
 extern void fairlock_init(struct fairlock *lock);
+extern void fairlock_init_capacity(struct fairlock *lock, unsigned int capacity);
+extern void fairlock_set_mode(struct fairlock *lock, enum fairlock_mode mode);
+extern void fairlock_set_inactive_threshold(struct fairlock *lock, uint64_t threshold_ns);
+extern void fairlock_set_domain(struct fairlock *lock, struct lock_domain *domain);
 extern void fairlock_destroy(struct fairlock *lock);
 extern int fair_trylock(struct fairlock *lock, int fid);
-extern void fair_lock(struct fairlock *lock, int fid);
-extern void fair_unlock(struct fairlock *lock);
+extern void fair_lock_slow(struct fairlock *lock, int fid, unsigned int weight, int have_ticket);
+extern void fairlock_set_weight(struct fairlock *lock, int fid, unsigned int weight);
+extern void fair_unlock_slow(struct fairlock *lock);
+extern void fair_unlock_cond(struct fairlock *lock);
+extern void fairlock_cond_return(struct fairlock *lock);
+extern void fair_combine_weighted(struct fairlock *lock, int fid, unsigned int weight,
+                                  void (*fn)(void *arg), void *arg);
+
+/* Per-critical-section timestamps are always needed for stats. */
+#ifdef LOCKSTAT
+#define FAIRLOCK_TRACK_CS 1
+#else
+#define FAIRLOCK_TRACK_CS 0
+#endif
+
+struct fairlock_waiter {
+    uint64_t banned_until;  // ns, now_ns() clock
+    uint64_t start_ticks;
+    uint64_t end_ticks;
+    struct list_head list;    
+    int fid;             // Fiber ID
+    unsigned int weight;
+    int cond_parked;     // counted in lock->cond_parked / cond_weight
+};
+
+/* Clamp a requested weight; 0 means the default. */
+static inline unsigned int fairlock_weight(unsigned int weight)
+{
+    if (weight == 0)
+        return FAIRLOCK_DEFAULT_WEIGHT;
+    return weight > FAIRLOCK_MAX_WEIGHT ? FAIRLOCK_MAX_WEIGHT : weight;
+}
+
+/* Take the ticket if nobody holds or is waiting for the lock. */
+static inline int fairlock_try_ticket(struct fairlock *lock)
+{
+    int serving = atomic_load(&lock->now_serving);
+
+    return atomic_compare_exchange_strong(&lock->next_ticket, &serving, serving + 1);
+}
+
+/* fid's ban deadline as last published, 0 if it has no entry. Needs no ticket. */
+static inline uint64_t fairlock_ban_hint(struct fairlock *lock, int fid)
+{
+    struct fairlock_ban_slot *slot = &lock->bans[(unsigned int)fid & (FAIRLOCK_BAN_SLOTS - 1)];
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    uint64_t banned_until;
+
+    if ((seq & 1) || atomic_load_explicit(&slot->fid, memory_order_relaxed) != fid)
+        return 0;
+    banned_until = atomic_load_explicit(&slot->banned_until, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+        return 0;
+    return banned_until;
+}
+
+/* Hand the lock to the next ticket and wake it if it has parked. */
+static inline void fairlock_pass(struct fairlock *lock)
+{
+    unsigned int next = atomic_fetch_add(&lock->now_serving, 1) + 1;
+    struct fairlock_park_slot *slot = &lock->park[next % FAIRLOCK_PARK_SLOTS];
+
+    atomic_store(&slot->turn, next);
+    if (atomic_load(&slot->parked) > 0) {
+        fiber_mutex_lock(&slot->mutex);
+        fiber_cond_broadcast(&slot->cond);
+        fiber_mutex_unlock(&slot->mutex);
+    }
+    ban_queue_poll();
+}
+
+/*
+ * Uncontended fast path. If the ticket is free, one CAS takes it. If the
+ * caller also held the lock last, lock->holder is still its waiter: that
+ * waiter is at the LRU tail already and the reaper never frees the holder,
+ * so the hash lookup and the list update are skipped. While it is the only
+ * fiber the lock tracks it cannot be banned and nothing is charged, so
+ * neither acquire nor release reads the clock; its timestamps are settled
+ * when a second fiber first takes the lock. With company, a published ban
+ * sends the fiber to wait it out before it touches the ticket.
+ * Anything else, and every lock in an accounting domain, goes through
+ * fair_lock_slow() / fair_unlock_slow().
+ */
+static inline void fair_lock_weighted(struct fairlock *lock, int fid, unsigned int weight)
+{
+    struct fairlock_waiter *waiter;
+    uint64_t now = 0;
+    int shared = atomic_load_explicit(&lock->num_threads, memory_order_relaxed) > 1;
+
+    if (__builtin_expect(lock->domain != NULL, 0)) {
+        fair_lock_slow(lock, fid, weight, 0);
+        return;
+    }
+    if (shared) {
+        now = now_ns();
+        if (__builtin_expect(fairlock_ban_hint(lock, fid) > now, 0)) {
+            fair_lock_slow(lock, fid, weight, 0);
+            return;
+        }
+    }
+    if (!fairlock_try_ticket(lock)) {
+        fair_lock_slow(lock, fid, weight, 0);
+        return;
+    }
+    waiter = lock->holder;
+    if (__builtin_expect(!waiter || waiter->fid != fid ||
+                         (weight != 0 && fairlock_weight(weight) != waiter->weight), 0)) {
+        fair_lock_slow(lock, fid, weight, 1);
+        return;
+    }
+    /*
+     * Look again under the ticket, where num_threads cannot change: a second
+     * fiber may have been added (fairlock_set_weight()) since the first look,
+     * and fair_unlock() will then charge from start_ticks.
+     */
+    shared = atomic_load_explicit(&lock->num_threads, memory_order_relaxed) > 1;
+    if (FAIRLOCK_TRACK_CS || shared) {
+        if (!now)
+            now = now_ns();
+        if (waiter->end_ticks < waiter->banned_until && now < waiter->banned_until) {
+            fair_lock_slow(lock, fid, weight, 1);
+            return;
+        }
+        waiter->start_ticks = now;
+    }
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, (uintptr_t)fid, 0);)
+}
+
+static inline void fair_unlock(struct fairlock *lock)
+{
+    if (__builtin_expect(atomic_load_explicit(&lock->num_threads, memory_order_relaxed) > 1 ||
+                         lock->domain != NULL, 0)) {
+        fair_unlock_slow(lock);
+        return;
+    }
+    /* Sole user: no ban to charge. create_waiter() stamps end_ticks once it has company. */
+    LOCKSTAT_ONLY(lockstat_released(&lock->stats, now_ns() - lock->holder->start_ticks);)
+    fairlock_pass(lock);
+}
+
+static inline void fair_lock(struct fairlock *lock, int fid)
+{
+    fair_lock_weighted(lock, fid, 0);
+}
+
+static inline void fair_combine(struct fairlock *lock, int fid, void (*fn)(void *arg), void *arg)
+{
+    fair_combine_weighted(lock, fid, 0, fn, arg);
+}
 
 #endif /* __LINUX_FAIRLOCK_H */
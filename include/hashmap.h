@@ -7,110 +7,157 @@
 #include <string.h>  /* for memset */
 
 /*
- * Simple doubly-linked 'hlist' for each bucket.
- * We only need next/pprev in this minimal version.
+ * Growable open-addressing hash map from an integer key (a fiber id or a
+ * pointer) to a non-NULL pointer value.
+ *
+ * Entries live inline in one power-of-two array and collisions are resolved
+ * by linear probing, so a lookup is a multiply, a shift and (usually) a single
+ * cache line. Keys are spread with Fibonacci hashing, so sequential fids do
+ * not pile into the same probe run. The table doubles once it is half full,
+ * and deletions use backward-shift instead of tombstones, so probe lengths
+ * stay short however many keys come and go.
+ *
+ * A NULL value marks an empty slot.
  */
-struct hlist_node {
-    struct hlist_node *next, **pprev;
+
+#define HASHMAP_MIN_BITS 4
+
+struct hashmap_entry {
+    uintptr_t key;
+    void *value;
 };
 
-struct hlist_head {
-    struct hlist_node *first;
+struct hashmap {
+    struct hashmap_entry *slots;
+    unsigned int bits;
+    size_t count;
 };
 
-static inline void INIT_HLIST_NODE(struct hlist_node *h)
+static inline size_t _hashmap_index(uintptr_t key, unsigned int bits)
 {
-    h->next  = NULL;
-    h->pprev = NULL;
+    return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
 }
 
-static inline void INIT_HLIST_HEAD(struct hlist_head *h)
-    {
-        h->first = NULL;
+static inline size_t _hashmap_mask(const struct hashmap *map)
+{
+    return ((size_t)1 << map->bits) - 1;
 }
 
-/* A container_of() macro like the Linux kernel */
-#ifndef container_of
-#define container_of(ptr, type, member) \
-    ((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
-#endif
+/* Initialize an empty map with room for 2^bits slots. Returns 0 on success. */
+static inline int hashmap_init(struct hashmap *map, unsigned int bits)
+{
+    if (bits < HASHMAP_MIN_BITS)
+        bits = HASHMAP_MIN_BITS;
 
-/* Initialize all buckets in a hashtable to empty. */
-#define hash_init(ht) do {                                          \
-    size_t __i, __size = (sizeof(ht) / sizeof((ht)[0]));            \
-    for (__i = 0; __i < __size; __i++) {                            \
-        INIT_HLIST_HEAD(&(ht)[__i]);                                \
-    }                                                               \
-} while (0)
+    map->slots = (struct hashmap_entry *)calloc((size_t)1 << bits, sizeof(*map->slots));
+    map->bits  = map->slots ? bits : 0;
+    map->count = 0;
+    return map->slots ? 0 : -1;
+}
 
-/*
- * Basic hash function that masks the lower bits of 'key'
- * according to 'bits'.
- */
-static inline unsigned int _hash_key(unsigned int key, unsigned int bits)
+static inline void hashmap_destroy(struct hashmap *map)
 {
-    return key & ((1U << bits) - 1U);
+    free(map->slots);
+    map->slots = NULL;
+    map->bits  = 0;
+    map->count = 0;
 }
 
-/* Insert a node at the head of an hlist bucket */
-static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *head)
+static inline void *hashmap_get(const struct hashmap *map, uintptr_t key)
 {
-    struct hlist_node *first = head->first;
-    n->next = first;
-    if (first)
-        first->pprev = &n->next;
-    head->first = n;
-    n->pprev = &head->first;
+    size_t mask = _hashmap_mask(map);
+    size_t i = _hashmap_index(key, map->bits);
+
+    while (map->slots[i].value) {
+        if (map->slots[i].key == key)
+            return map->slots[i].value;
+        i = (i + 1) & mask;
+    }
+    return NULL;
 }
 
-/* Remove a node from whichever bucket it belongs to */
-static inline void hlist_del(struct hlist_node *n)
+/* Place an entry known not to be in the map; the caller guarantees room. */
+static inline void _hashmap_place(struct hashmap *map, uintptr_t key, void *value)
 {
-    struct hlist_node *next = n->next;
-    struct hlist_node **pprev = n->pprev;
-
-    if (pprev) {
-        *pprev = next;
-        if (next)
-            next->pprev = pprev;
-        n->next = NULL;
-        n->pprev = NULL;
+    size_t mask = _hashmap_mask(map);
+    size_t i = _hashmap_index(key, map->bits);
+
+    while (map->slots[i].value)
+        i = (i + 1) & mask;
+    map->slots[i].key   = key;
+    map->slots[i].value = value;
+    map->count++;
+}
+
+static inline int _hashmap_grow(struct hashmap *map)
+{
+    struct hashmap old = *map;
+    size_t i;
+
+    if (hashmap_init(map, old.bits + 1) != 0) {
+        *map = old;
+        return -1;
     }
+    for (i = 0; i < ((size_t)1 << old.bits); i++) {
+        if (old.slots[i].value)
+            _hashmap_place(map, old.slots[i].key, old.slots[i].value);
+    }
+    free(old.slots);
+    return 0;
 }
 
-/*
- * hash_add: Add 'node' to the bucket for 'key'.
- * bits=8 means 256 buckets, so index = key & 255.
- */
-#define hash_add(ht, node, key) do {                             \
-    unsigned int __index = _hash_key((key), 8 /* or your bits */); \
-    hlist_add_head((node), &(ht)[__index]);                      \
-} while (0)
+/* Insert or replace the value for key. Returns 0 on success, -1 if growing failed. */
+static inline int hashmap_put(struct hashmap *map, uintptr_t key, void *value)
+{
+    size_t mask = _hashmap_mask(map);
+    size_t i = _hashmap_index(key, map->bits);
 
-/*
- * hash_del: remove a node from the hashtable
- */
-#define hash_del(node) hlist_del(node)
+    while (map->slots[i].value) {
+        if (map->slots[i].key == key) {
+            map->slots[i].value = value;
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
 
-/*
- * hash_for_each_possible: iterate over all nodes in the bucket for 'key'.
- *
- * Usage:
- *   struct fairlock_waiter *waiter;
- *   hash_for_each_possible(lock->waiters_lookup, waiter, hash, fid) {
- *       if (waiter->fid == fid)
- *           return waiter;
- *   }
- *
- * Where:
- *   - (ht)  : your hashtable array
- *   - (obj) : loop cursor of type pointer (e.g. struct fairlock_waiter *)
- *   - (member) : the hlist_node field name in your struct
- *   - (key) : integer key
- */
-#define hash_for_each_possible(ht, obj, member, key)                               \
-    for (struct hlist_node *__pos = (ht)[_hash_key((key), 8)].first; __pos != NULL; \
-         __pos = __pos->next)                                                     \
-        if (((obj) = container_of(__pos, typeof(*(obj)), member)), true)
+    /* Keep the load factor at or below 1/2. */
+    if ((map->count + 1) * 2 > ((size_t)1 << map->bits)) {
+        if (_hashmap_grow(map) != 0)
+            return -1;
+    }
+    _hashmap_place(map, key, value);
+    return 0;
+}
+
+/* Remove key from the map, returning its value (or NULL if absent). */
+static inline void *hashmap_del(struct hashmap *map, uintptr_t key)
+{
+    size_t mask = _hashmap_mask(map);
+    size_t i = _hashmap_index(key, map->bits);
+    size_t j, home;
+    void *value;
+
+    while (map->slots[i].value && map->slots[i].key != key)
+        i = (i + 1) & mask;
+    if (!map->slots[i].value)
+        return NULL;
+
+    value = map->slots[i].value;
+    map->count--;
+
+    /* Backward-shift: pull later members of the probe run into the hole. */
+    j = i;
+    for (;;) {
+        map->slots[i].value = NULL;
+        do {
+            j = (j + 1) & mask;
+            if (!map->slots[j].value)
+                return value;
+            home = _hashmap_index(map->slots[j].key, map->bits);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        map->slots[i] = map->slots[j];
+        i = j;
+    }
+}
 
 #endif /* __HASHMAP_H__ */
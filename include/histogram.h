@@ -0,0 +1,92 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Histograms are log-linear: values below 2^HISTOGRAM_SUB_BITS get a bucket
+ * each, and every power of two above that is split into 2^HISTOGRAM_SUB_BITS
+ * buckets, so a recorded value is within 1/2^HISTOGRAM_SUB_BITS of its bucket.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static inline unsigned int histogram_bucket(uint64_t value)
+{
+    unsigned int exp;
+
+    if (value < HISTOGRAM_SUB_COUNT)
+        return (unsigned int)value;
+    exp = 63 - __builtin_clzll(value);
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+           (unsigned int)((value >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* Smallest value that falls into bucket b. */
+static inline uint64_t histogram_bucket_value(unsigned int b)
+{
+    unsigned int exp;
+
+    if (b < HISTOGRAM_SUB_COUNT)
+        return b;
+    exp = b / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+    return ((uint64_t)1 << exp) |
+           ((uint64_t)(b % HISTOGRAM_SUB_COUNT) << (exp - HISTOGRAM_SUB_BITS));
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t value)
+{
+    if (h->count == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[histogram_bucket(value)]++;
+}
+
+static inline void histogram_merge(struct histogram *into, const struct histogram *from)
+{
+    unsigned int b;
+
+    if (from->count == 0)
+        return;
+    if (into->count == 0 || from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        into->buckets[b] += from->buckets[b];
+    }
+}
+
+static inline uint64_t histogram_percentile(const struct histogram *h, double pct)
+{
+    uint64_t rank, seen = 0;
+    unsigned int b;
+
+    if (h->count == 0)
+        return 0;
+    rank = (uint64_t)(pct / 100.0 * (double)h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank)
+            return histogram_bucket_value(b);
+    }
+    return h->max;
+}
+
+#endif /* _HISTOGRAM_H_ */
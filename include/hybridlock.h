@@ -0,0 +1,197 @@
+#ifndef _FIBER_HYBRIDLOCK_H_
+#define _FIBER_HYBRIDLOCK_H_
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "timing.h"
+#include "hashmap.h"
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "banqueue.h"
+#include "lockstat.h"
+
+/*
+ * A fiber_mutex_t that charges fair-share usage only while that buys
+ * something.
+ *
+ * In HYBRID_MUTEX mode, acquire and release are fiber_mutex_lock/unlock, plus
+ * a note of whether the lock was busy and a clock reading on one critical
+ * section in 2^HYBRIDLOCK_SAMPLE_SHIFT per fiber. Those samples feed a
+ * per-fiber EWMA of critical-section length.
+ *
+ * In HYBRID_FAIR mode, every critical section is timed and charged as in
+ * sched_rwlock. A section of cs_length pushes its fiber's ban to
+ * max(banned_until, start) + cs_length * nthreads, where nthreads counts the
+ * fibers active in the last review (see hybridlock_end_window()). A banned fiber waits in the
+ * ban queue before it touches the mutex.
+ *
+ * Every HYBRIDLOCK_WINDOW acquisitions, the holder reviews the window:
+ *  - contention: the share of acquisitions that found the mutex held. Waiting
+ *    out a ban does not count, or the bans fair mode imposes would keep it
+ *    on after real contention has gone;
+ *  - skew: the longest per-fiber EWMA over the shortest, among active fibers.
+ * The lock turns fair once both reach the _ON thresholds, and goes back to
+ * mutex mode once either drops below its _OFF threshold.
+ *
+ * Per-fiber state lives in a table inside the lock, claimed the same way as
+ * sched_lock's. A fiber that finds no slot is never timed or banned.
+ */
+#ifndef HYBRIDLOCK_WINDOW
+#define HYBRIDLOCK_WINDOW 1024
+#endif
+#ifndef HYBRIDLOCK_SAMPLE_SHIFT
+#define HYBRIDLOCK_SAMPLE_SHIFT 3
+#endif
+#ifndef HYBRIDLOCK_EWMA_SHIFT
+#define HYBRIDLOCK_EWMA_SHIFT 3
+#endif
+#ifndef HYBRIDLOCK_CONTENDED_ON_PCT
+#define HYBRIDLOCK_CONTENDED_ON_PCT 25
+#endif
+#ifndef HYBRIDLOCK_CONTENDED_OFF_PCT
+#define HYBRIDLOCK_CONTENDED_OFF_PCT 10
+#endif
+#ifndef HYBRIDLOCK_SKEW_ON_PCT
+#define HYBRIDLOCK_SKEW_ON_PCT 200
+#endif
+#ifndef HYBRIDLOCK_SKEW_OFF_PCT
+#define HYBRIDLOCK_SKEW_OFF_PCT 150
+#endif
+#ifndef HYBRIDLOCK_FIBER_SLOTS
+#define HYBRIDLOCK_FIBER_SLOTS 256
+#endif
+#ifndef HYBRIDLOCK_FIBER_PROBES
+#define HYBRIDLOCK_FIBER_PROBES 16
+#endif
+
+/* Per-critical-section timestamps are always needed for stats. */
+#ifdef LOCKSTAT
+#define HYBRIDLOCK_TRACK_CS 1
+#else
+#define HYBRIDLOCK_TRACK_CS 0
+#endif
+
+enum hybrid_mode {
+    HYBRID_MUTEX = 0,
+    HYBRID_FAIR,
+};
+
+/* Written by the fiber that claimed the slot, while it holds the mutex. */
+struct hybridlock_fiber {
+    atomic_uintptr_t fiber;   // 0 while the slot is free
+    uint64_t banned_until;    // ns, now_ns() clock
+    uint64_t cs_ewma_ns;      // 0 until the first timed section
+    uint64_t window;          // last window with a timed section
+    unsigned int acquires;
+};
+
+struct hybridlock_stats {
+    uint64_t acquires;
+    uint64_t contended;       // found the mutex held
+    uint64_t fair_acquires;   // taken in HYBRID_FAIR mode
+    uint64_t to_fair;         // mode switches
+    uint64_t to_mutex;
+    int mode;
+};
+
+struct hybridlock {
+    fiber_mutex_t mutex;
+    atomic_int mode;
+    /* Only touched by the holder. */
+    struct hybridlock_fiber *holder;   // its slot, NULL if it has none
+    uint64_t start;                    // 0 if this section is not timed
+    unsigned int window_acquires;
+    unsigned int window_contended;
+    uint64_t window;
+    unsigned int nthreads;             // fibers active in the last window
+    struct hybridlock_stats counters;
+    struct hybridlock_fiber *fibers;
+    unsigned int fiber_bits;
+    LOCKSTAT_ONLY(struct lockstat stats;)
+};
+
+void hybridlock_init(struct hybridlock *lock);
+void hybridlock_destroy(struct hybridlock *lock);
+void hybridlock_get_stats(struct hybridlock *lock, struct hybridlock_stats *out);
+void hybridlock_end_window(struct hybridlock *lock);
+
+/* The calling fiber's slot in the lock's fiber table, claimed on first use. NULL if none is free. */
+static inline struct hybridlock_fiber *hybridlock_fiber(struct hybridlock *lock, uintptr_t self)
+{
+    size_t mask = ((size_t)1 << lock->fiber_bits) - 1;
+    size_t i = _hashmap_index(self, lock->fiber_bits);
+    uintptr_t key;
+    int n;
+
+    for (n = 0; n < HYBRIDLOCK_FIBER_PROBES; n++, i = (i + 1) & mask) {
+        key = atomic_load_explicit(&lock->fibers[i].fiber, memory_order_acquire);
+        if (key == self)
+            return &lock->fibers[i];
+        if (key == 0 && atomic_compare_exchange_strong(&lock->fibers[i].fiber, &key, self))
+            return &lock->fibers[i];
+    }
+    return NULL;
+}
+
+static inline void hybrid_lock(struct hybridlock *lock)
+{
+    uintptr_t self = (uintptr_t)fiber_manager_get()->current_fiber;
+    struct hybridlock_fiber *me = hybridlock_fiber(lock, self);
+    int fair = atomic_load_explicit(&lock->mode, memory_order_relaxed) == HYBRID_FAIR;
+    int busy = 0;
+    LOCKSTAT_ONLY(uint64_t wait_start = now_ns();)
+
+    if (fair && me && me->banned_until > now_ns())
+        ban_queue_wait(me->banned_until);
+    if (!fiber_mutex_trylock(&lock->mutex)) {
+        fiber_mutex_lock(&lock->mutex);
+        busy = 1;
+    }
+
+    /* The mode may have changed while we waited; it is stable now we hold the mutex. */
+    fair = atomic_load_explicit(&lock->mode, memory_order_relaxed) == HYBRID_FAIR;
+    lock->holder = me;
+    lock->window_acquires++;
+    lock->window_contended += busy;
+    lock->start = 0;
+    if (fair)
+        lock->counters.fair_acquires++;
+    if (fair || HYBRIDLOCK_TRACK_CS ||
+        (me && (me->acquires++ & ((1U << HYBRIDLOCK_SAMPLE_SHIFT) - 1)) == 0))
+        lock->start = now_ns();
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, self, now_ns() - wait_start);)
+}
+
+static inline void hybrid_unlock(struct hybridlock *lock)
+{
+    struct hybridlock_fiber *me = lock->holder;
+    uint64_t now, cs_length;
+
+    if (lock->start != 0) {
+        now = now_ns();
+        cs_length = now - lock->start;
+        LOCKSTAT_ONLY(lockstat_released(&lock->stats, cs_length);)
+        if (me) {
+            if (me->cs_ewma_ns == 0)
+                me->cs_ewma_ns = cs_length;
+            else
+                me->cs_ewma_ns += ((int64_t)cs_length - (int64_t)me->cs_ewma_ns) >>
+                                  HYBRIDLOCK_EWMA_SHIFT;
+            me->window = lock->window;
+            /* The mode only changes in hybridlock_end_window(), below. */
+            if (atomic_load_explicit(&lock->mode, memory_order_relaxed) == HYBRID_FAIR &&
+                lock->nthreads > 1) {
+                if (me->banned_until < lock->start)
+                    me->banned_until = lock->start;
+                me->banned_until += cs_length * lock->nthreads;
+                LOCKSTAT_ONLY(lockstat_banned(&lock->stats, me->banned_until - now);)
+            }
+        }
+    }
+    if (lock->window_acquires >= HYBRIDLOCK_WINDOW)
+        hybridlock_end_window(lock);
+    fiber_mutex_unlock(&lock->mutex);
+    ban_queue_poll();
+}
+
+#endif /* _FIBER_HYBRIDLOCK_H_ */
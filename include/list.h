@@ -25,6 +25,13 @@ static inline void __list_add(struct list_head *new_entry,
     prev->next      = new_entry;
 }
 
+/* Add new entry right after the head (stack order) */
+static inline void list_add(struct list_head *new_entry,
+                            struct list_head *head)
+{
+    __list_add(new_entry, head, head->next);
+}
+
 /* Add new entry at the tail of the list */
 static inline void list_add_tail(struct list_head *new_entry,
                                  struct list_head *head)
@@ -47,12 +54,30 @@ static inline void list_del(struct list_head *entry)
     entry->next = entry->prev = NULL;
 }
 
+/* Move an entry to the tail of another (or the same) list */
+static inline void list_move_tail(struct list_head *entry,
+                                  struct list_head *head)
+{
+    __list_del(entry->prev, entry->next);
+    list_add_tail(entry, head);
+}
+
+/* Test whether a list has no entries */
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
 /* Return pointer to struct that 'member' is embedded in */
 #ifndef container_of
 #define container_of(ptr, type, member) \
     ((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
 #endif
 
+/* Return the first struct in the list, given the head pointer */
+#define list_first_entry(head, type, member) \
+    container_of((head)->next, type, member)
+
 /* Return the struct for this entry, given the head pointer */
 #define list_last_entry(head, type, member) \
     container_of((head)->prev, type, member)
@@ -61,6 +86,22 @@ static inline void list_del(struct list_head *entry)
 #define list_prev_entry(pos, member) \
     container_of((pos)->member.prev, typeof(*(pos)), member)
 
+/* Return the next list entry for an element */
+#define list_next_entry(pos, member) \
+    container_of((pos)->member.next, typeof(*(pos)), member)
+
+/*
+ * list_for_each_entry_safe(pos, n, head, member)
+ *
+ * Safely iterate over the list from head to tail,
+ * allowing the removal of 'pos' from the list during iteration.
+ */
+#define list_for_each_entry_safe(pos, n, head, member)                        \
+    for (pos = list_first_entry(head, typeof(*pos), member),                  \
+         n   = list_next_entry(pos, member);                                  \
+         &pos->member != (head);                                              \
+         pos = n, n = list_next_entry(n, member))
+
 /*
  * list_for_each_entry_safe_reverse(pos, n, head, member)
  *
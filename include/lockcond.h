@@ -0,0 +1,83 @@
+#ifndef _LOCK_COND_H_
+#define _LOCK_COND_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "fiber_mutex.h"
+#include "fiber_cond.h"
+#include "schedlock.h"
+#include "fairlock.h"
+
+/*
+ * Condition variable for sched_lock and fairlock holders.
+ *
+ * sched_lock_cond_wait() / fair_cond_wait() leave the critical section and
+ * park the fiber in the fiber scheduler until lock_cond_signal() or
+ * lock_cond_broadcast(), then take the lock again through its ordinary
+ * acquire path. The fiber is filed as a waiter before it lets go of the lock,
+ * so a notify made under the lock after that point cannot be missed.
+ *
+ * Time spent waiting is never hold time:
+ *  - sched_lock: the wait ends the slice there and then
+ *    (sched_lock_release_slice()). The owner is banned for the slice up to
+ *    the wait, not for the wait, and the next fiber gets the lock at once
+ *    rather than when the idle slice runs out.
+ *  - fairlock: the wait is a fair_unlock(), which charges the section up to
+ *    the wait.
+ * The ban from that section still applies when the fiber is woken, and it is
+ * sat out in the ban queue like any other. While parked, the fiber is not
+ * competing for the lock, so it is left out of the fiber count (sched_lock)
+ * or total weight (fairlock) that other fibers' bans scale with.
+ *
+ * Waiters are woken oldest first. Nothing else wakes them, but a woken
+ * fiber only gets the lock back after others may have run, so callers
+ * re-check their predicate in a loop, as with pthread_cond_wait(). The
+ * predicate must only change under the lock the waiters use; the notify may
+ * come after the lock is let go, which saves the woken fiber running into it.
+ */
+
+/* A parked waiter; lives on its stack until woken. */
+struct lock_cond_waiter {
+    struct lock_cond_waiter *next;
+    int woken;
+    fiber_cond_t cond;
+};
+
+struct lock_cond_stats {
+    uint64_t waits;        // waits begun
+    uint64_t woken;        // waiters woken by a signal or broadcast
+    uint64_t wait_ns;      // total time parked, from leaving the lock to being woken
+};
+
+struct lock_cond {
+    fiber_mutex_t mutex;
+    struct lock_cond_waiter *head;   // oldest waiter, NULL if none
+    struct lock_cond_waiter *tail;
+    atomic_uint nwaiters;            // read without the mutex to skip idle notifies
+    struct lock_cond_stats stats;
+};
+
+void lock_cond_init(struct lock_cond *cond);
+void lock_cond_destroy(struct lock_cond *cond);
+void lock_cond_get_stats(struct lock_cond *cond, struct lock_cond_stats *out);
+void lock_cond_wake(struct lock_cond *cond, unsigned int n);
+void sched_lock_cond_wait(struct sched_lock *lock, struct lock_cond *cond);
+void fair_cond_wait(struct fairlock *lock, int fid, struct lock_cond *cond);
+
+/* Wake the oldest waiter, if any. */
+static inline void lock_cond_signal(struct lock_cond *cond)
+{
+    if (atomic_load_explicit(&cond->nwaiters, memory_order_acquire) == 0)
+        return;
+    lock_cond_wake(cond, 1);
+}
+
+/* Wake every waiter. */
+static inline void lock_cond_broadcast(struct lock_cond *cond)
+{
+    if (atomic_load_explicit(&cond->nwaiters, memory_order_acquire) == 0)
+        return;
+    lock_cond_wake(cond, UINT32_MAX);
+}
+
+#endif /* _LOCK_COND_H_ */
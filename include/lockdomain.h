@@ -0,0 +1,177 @@
+#ifndef _LOCK_DOMAIN_H_
+#define _LOCK_DOMAIN_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "timing.h"
+#include "hashmap.h"
+
+/*
+ * Accounting domain: fair-share bans across a group of locks.
+ *
+ * A lock's own bans only see that lock. A fiber that spreads its critical
+ * sections over the shards of a sharded structure is never held back by them.
+ * Locks attached to the same lock_domain (fairlock_set_domain(),
+ * sched_lock_set_domain()) also charge every hold to the fiber's record in the
+ * domain. A hold of cs_length ending at end pushes the fiber's domain ban to
+ * max(banned_until, end - cs_length) + cs_length * nfibers, where nfibers counts the
+ * fibers that used any lock of the domain within LOCK_DOMAIN_INACTIVE_NS. A
+ * fiber sits out its domain ban before it queues for any of the domain's
+ * locks. Per-lock bans still apply, and both run from the end of the same
+ * hold, so the longer of the two is the one that counts.
+ *
+ * Records are keyed by the running fiber (fairlock's fids are per lock) and
+ * claimed by CAS, as in sched_lock's fiber table. A fiber that finds no free
+ * record is not charged. nfibers is recounted by one releasing fiber at most
+ * every LOCK_DOMAIN_RECOUNT_NS. Domain totals are kept in per-worker
+ * counters, one cache line each and merged only when read, so charging never
+ * writes a line that other workers write too. A worker id is handed back
+ * when its thread exits and reused by the next one; more than
+ * LOCK_DOMAIN_MAX_WORKERS live threads charging at once is a fatal error
+ * rather than two threads sharing counters.
+ */
+#ifndef LOCK_DOMAIN_FIBER_SLOTS
+#define LOCK_DOMAIN_FIBER_SLOTS 256
+#endif
+#ifndef LOCK_DOMAIN_FIBER_PROBES
+#define LOCK_DOMAIN_FIBER_PROBES 16
+#endif
+#ifndef LOCK_DOMAIN_MAX_WORKERS
+#define LOCK_DOMAIN_MAX_WORKERS 64
+#endif
+#ifndef LOCK_DOMAIN_RECOUNT_NS
+#define LOCK_DOMAIN_RECOUNT_NS (1000 * NSEC_PER_USEC)
+#endif
+#ifndef LOCK_DOMAIN_INACTIVE_NS
+#define LOCK_DOMAIN_INACTIVE_NS NSEC_PER_SEC
+#endif
+
+#define LOCK_DOMAIN_CACHELINE 64
+
+/* A fiber's record. Charged by whichever fiber ran its critical section. */
+struct lock_domain_fiber {
+    atomic_uintptr_t fiber;            // 0 while the slot is free
+    _Atomic uint64_t banned_until;     // ns, now_ns() clock
+    _Atomic uint64_t hold_ns;          // total over the domain's locks
+    _Atomic uint64_t last_ns;          // end of its latest hold
+};
+
+struct lock_domain_worker {
+    _Alignas(LOCK_DOMAIN_CACHELINE) uint64_t hold_ns;
+    uint64_t charges;
+    uint64_t ban_waits;
+};
+
+struct lock_domain_stats {
+    uint64_t hold_ns;          // hold time charged, all fibers
+    uint64_t charges;          // critical sections (sched_lock: slices) charged
+    uint64_t ban_waits;        // acquisitions that found a domain ban
+    unsigned int nfibers;      // active fibers at the last recount
+    uint64_t max_fiber_hold_ns;
+};
+
+struct lock_domain {
+    struct lock_domain_fiber *fibers;
+    unsigned int fiber_bits;
+    atomic_uint nfibers;
+    _Atomic uint64_t recount_at;
+    struct lock_domain_worker workers[LOCK_DOMAIN_MAX_WORKERS];
+};
+
+extern __thread int lock_domain_worker_id;
+
+void lock_domain_init(struct lock_domain *domain);
+void lock_domain_destroy(struct lock_domain *domain);
+void lock_domain_get_stats(struct lock_domain *domain, struct lock_domain_stats *out);
+uint64_t lock_domain_fiber_hold(struct lock_domain *domain, uintptr_t fiber);
+struct lock_domain_worker *lock_domain_worker_slow(struct lock_domain *domain);
+void lock_domain_recount(struct lock_domain *domain, uint64_t now);
+
+/* This worker's counters. */
+static inline struct lock_domain_worker *lock_domain_worker(struct lock_domain *domain)
+{
+    if (__builtin_expect(lock_domain_worker_id >= 0, 1))
+        return &domain->workers[lock_domain_worker_id];
+    return lock_domain_worker_slow(domain);
+}
+
+/* fiber's record, claimed on first use. NULL if none is free. */
+static inline struct lock_domain_fiber *lock_domain_fiber(struct lock_domain *domain,
+                                                          uintptr_t fiber)
+{
+    size_t mask = ((size_t)1 << domain->fiber_bits) - 1;
+    size_t i = _hashmap_index(fiber, domain->fiber_bits);
+    uintptr_t key;
+    int n;
+
+    for (n = 0; n < LOCK_DOMAIN_FIBER_PROBES; n++, i = (i + 1) & mask) {
+        key = atomic_load_explicit(&domain->fibers[i].fiber, memory_order_acquire);
+        if (key == fiber)
+            return &domain->fibers[i];
+        if (key == 0 &&
+            atomic_compare_exchange_strong(&domain->fibers[i].fiber, &key, fiber))
+            return &domain->fibers[i];
+    }
+    return NULL;
+}
+
+/*
+ * fiber's domain ban if it has not run out yet, else 0. Locks call this before
+ * queuing and sit the ban out their own way.
+ */
+static inline uint64_t lock_domain_ban(struct lock_domain *domain, uintptr_t fiber)
+{
+    struct lock_domain_fiber *f = lock_domain_fiber(domain, fiber);
+    uint64_t ban;
+
+    if (!f)
+        return 0;
+    ban = atomic_load_explicit(&f->banned_until, memory_order_relaxed);
+    if (ban <= now_ns())
+        return 0;
+    lock_domain_worker(domain)->ban_waits++;
+    return ban;
+}
+
+/*
+ * Charge fiber for cs_length of critical sections under a domain lock, the
+ * last of which ended at end (now_ns() clock).
+ */
+static inline void lock_domain_charge(struct lock_domain *domain, uintptr_t fiber,
+                                      uint64_t cs_length, uint64_t end)
+{
+    struct lock_domain_fiber *f = lock_domain_fiber(domain, fiber);
+    struct lock_domain_worker *w = lock_domain_worker(domain);
+    uint64_t start = end - cs_length;
+    uint64_t ban;
+    unsigned int nfibers;
+
+    w->hold_ns += cs_length;
+    w->charges++;
+    if (f) {
+        atomic_fetch_add_explicit(&f->hold_ns, cs_length, memory_order_relaxed);
+        atomic_store_explicit(&f->last_ns, end, memory_order_relaxed);
+    }
+    if (end >= atomic_load_explicit(&domain->recount_at, memory_order_relaxed))
+        lock_domain_recount(domain, end);
+    if (!f)
+        return;
+
+    /*
+     * A fiber can be charged by several locks at once (sched_lock slices of
+     * different shards, or a waiter closing its expired slice), so the ban
+     * is extended by CAS rather than overwritten.
+     */
+    nfibers = atomic_load_explicit(&domain->nfibers, memory_order_relaxed);
+    if (nfibers > 1) {
+        ban = atomic_load_explicit(&f->banned_until, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&f->banned_until, &ban,
+                                                      (ban < start ? start : ban) +
+                                                          cs_length * nfibers,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+        }
+    }
+}
+
+#endif /* _LOCK_DOMAIN_H_ */
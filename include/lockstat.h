@@ -0,0 +1,158 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Per-lock statistics: acquire counts per fiber, histograms of wait, hold and
+ * ban time, handoffs, slice expirations and ban requeues (tickets handed back
+ * because the fiber holding them was still banned).
+ *
+ * Only compiled in with -DLOCKSTAT. Without it, everything wrapped in
+ * LOCKSTAT_ONLY() disappears and the locks carry no stats field.
+ *
+ * Each worker thread records into its own buffer, allocated the first time
+ * that thread touches the lock, so the hot path is plain loads and stores.
+ * Per-fiber acquire counts live in a fixed table inside that buffer, so
+ * recording never allocates and a concurrent dump never sees memory freed
+ * under it; fibers that find no free slot within LOCKSTAT_FIBER_PROBE probes
+ * are counted together as "other". Buffers are merged only when dumping. A
+ * dump taken while the locks are in use may be slightly torn, which is fine
+ * for monitoring.
+ *
+ * A worker id is handed back when its thread exits and reused by the next
+ * one. More than LOCKSTAT_MAX_WORKERS live threads recording at once is a
+ * fatal error rather than two threads sharing one buffer.
+ *
+ * lockstat_dump_json() writes every registered lock as JSON. After
+ * lockstat_init(), the same dump is written on SIGUSR1, to stderr or to the
+ * file named by $LOCKSTAT_FILE. lockstat_init() must run before any other
+ * thread is created so they all inherit the blocked signal.
+ */
+
+#ifdef LOCKSTAT
+#define LOCKSTAT_ONLY(...) __VA_ARGS__
+#else
+#define LOCKSTAT_ONLY(...)
+#endif
+
+#ifdef LOCKSTAT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "hashmap.h"  /* for _hashmap_index */
+#include "histogram.h"
+
+/* Live worker threads that may record at once. */
+#ifndef LOCKSTAT_MAX_WORKERS
+#define LOCKSTAT_MAX_WORKERS 64
+#endif
+
+/* Per-worker fiber slots (a power of two) and how far an acquire probes. */
+#ifndef LOCKSTAT_FIBER_BITS
+#define LOCKSTAT_FIBER_BITS 8
+#endif
+#define LOCKSTAT_FIBER_SLOTS (1 << LOCKSTAT_FIBER_BITS)
+#define LOCKSTAT_FIBER_PROBE 8
+
+struct lockstat_fiber {
+    uintptr_t key;
+    uint64_t acquires;               // 0 marks a free slot
+};
+
+struct lockstat_worker {
+    uint64_t acquires;
+    uint64_t handoffs;
+    uint64_t slice_expirations;
+    uint64_t ban_requeues;
+    struct histogram wait;
+    struct histogram hold;
+    struct histogram ban;
+    uint64_t other_acquires;         // fibers that found no slot
+    struct lockstat_fiber fibers[LOCKSTAT_FIBER_SLOTS];
+};
+
+struct lockstat {
+    const char *name;
+    const void *lock;
+    _Atomic(struct lockstat_worker *) workers[LOCKSTAT_MAX_WORKERS];
+    struct lockstat *next;
+};
+
+extern __thread int lockstat_worker_id;
+
+void lockstat_register(struct lockstat *ls, const char *name, const void *lock);
+void lockstat_unregister(struct lockstat *ls);
+void lockstat_dump_json(FILE *out);
+void lockstat_dump(void);
+void lockstat_init(void);
+
+/* Allocate this worker's buffer for ls (lockstat.c). */
+struct lockstat_worker *lockstat_local_slow(struct lockstat *ls);
+
+/* This worker's buffer for ls, allocated on first use. */
+static inline struct lockstat_worker *lockstat_local(struct lockstat *ls)
+{
+    struct lockstat_worker *w;
+
+    if (__builtin_expect(lockstat_worker_id >= 0, 1)) {
+        w = atomic_load_explicit(&ls->workers[lockstat_worker_id], memory_order_acquire);
+        if (__builtin_expect(w != NULL, 1))
+            return w;
+    }
+    return lockstat_local_slow(ls);
+}
+
+static inline void lockstat_acquired(struct lockstat *ls, uintptr_t fiber, uint64_t wait_ns)
+{
+    struct lockstat_worker *w = lockstat_local(ls);
+    size_t i = _hashmap_index(fiber, LOCKSTAT_FIBER_BITS);
+    int probe;
+
+    w->acquires++;
+    histogram_record(&w->wait, wait_ns);
+    for (probe = 0; probe < LOCKSTAT_FIBER_PROBE; probe++) {
+        struct lockstat_fiber *f = &w->fibers[i];
+
+        if (f->acquires == 0) {
+            f->key = fiber;
+            f->acquires = 1;
+            return;
+        }
+        if (f->key == fiber) {
+            f->acquires++;
+            return;
+        }
+        i = (i + 1) & (LOCKSTAT_FIBER_SLOTS - 1);
+    }
+    w->other_acquires++;
+}
+
+static inline void lockstat_released(struct lockstat *ls, uint64_t hold_ns)
+{
+    histogram_record(&lockstat_local(ls)->hold, hold_ns);
+}
+
+static inline void lockstat_banned(struct lockstat *ls, uint64_t ban_ns)
+{
+    histogram_record(&lockstat_local(ls)->ban, ban_ns);
+}
+
+static inline void lockstat_handoff(struct lockstat *ls)
+{
+    lockstat_local(ls)->handoffs++;
+}
+
+static inline void lockstat_slice_expired(struct lockstat *ls)
+{
+    lockstat_local(ls)->slice_expirations++;
+}
+
+static inline void lockstat_ban_requeue(struct lockstat *ls)
+{
+    lockstat_local(ls)->ban_requeues++;
+}
+
+#endif /* LOCKSTAT */
+
+#endif /* _LOCKSTAT_H_ */
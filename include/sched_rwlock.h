@@ -0,0 +1,63 @@
+#ifndef _FIBER_SCHED_RWLOCK_H_
+#define _FIBER_SCHED_RWLOCK_H_
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "timing.h"
+#include "fiber_manager.h"
+#include "schedlock.h"
+#include "lockstat.h"
+
+/*
+ * Reader-writer variant of sched_lock.
+ *
+ * Lock time alternates between read slices, in which any number of readers
+ * hold the lock together, and write slices, in which writers take it one at a
+ * time. Once a slice has run for slice_ns, the other side takes over as soon
+ * as one of its fibers is waiting; if nobody is waiting there, the current
+ * phase carries on.
+ *
+ * Usage is charged per fiber in either mode: a critical section of cs_length
+ * pushes that fiber's ban to max(banned_until, start) + cs_length * nthreads.
+ * Bans are kept in now_ns() time in a per-fiber table inside the lock,
+ * claimed the same way as sched_lock's, so neither acquire nor release goes
+ * through libfiber's lock data or the wall clock. A fiber that finds no slot
+ * is never banned.
+ *
+ * Readers enter with one atomic increment. Phase switches and writer entry
+ * are serialised by a short internal guard.
+ */
+
+enum sched_rw_phase {
+    SCHED_RW_READ = 0,
+    SCHED_RW_WRITE,
+};
+
+/* Per-critical-section state, kept by the caller between acquire and release. */
+struct sched_rw_hold {
+    uint64_t start;
+    struct sched_lock_fiber *me;   // the holder's slot, NULL if it has none
+};
+
+struct sched_rwlock {
+    atomic_int phase;
+    _Atomic uint64_t phase_end;
+    atomic_int readers;          // readers inside a critical section
+    atomic_uintptr_t writer;     // writer inside a critical section, 0 if none
+    atomic_int waiting_readers;
+    atomic_int waiting_writers;
+    atomic_flag guard;
+    uint64_t slice_ns;
+    struct sched_lock_fiber *fibers;
+    unsigned int fiber_bits;
+    LOCKSTAT_ONLY(struct lockstat stats;)
+};
+
+void sched_rwlock_init(struct sched_rwlock *lock);
+void sched_rwlock_destroy(struct sched_rwlock *lock);
+void sched_read_acquire(struct sched_rwlock *lock, struct sched_rw_hold *hold);
+void sched_read_release(struct sched_rwlock *lock, struct sched_rw_hold *hold);
+void sched_write_acquire(struct sched_rwlock *lock, struct sched_rw_hold *hold);
+void sched_write_release(struct sched_rwlock *lock, struct sched_rw_hold *hold);
+
+#endif
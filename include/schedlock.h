@@ -2,101 +2,372 @@
 #define _FIBER_SCHED_LOCK_H_
 
 #include <stdio.h>                  
+#include <string.h>
 #include <stdbool.h>        
 #include <stdatomic.h>                   
+#include <unistd.h>
+#include <sys/syscall.h>
 #include "timing.h"         
 #include "fiber_manager.h"  
+#include "fiber_io.h"
 #include "fairlock.h" 
 #include "fiber_mutex.h"  
 #include "fiber_spinlock.h"
+#include "hashmap.h"
+#include "lockstat.h"
+#include "lockdomain.h"
 
 #define SLICE_SIZE_US 100
 
+/* Polls of the owner word before a waiting fiber starts yielding. */
+#ifndef SCHED_LOCK_SPIN_LIMIT
+#define SCHED_LOCK_SPIN_LIMIT 1024
+#endif
+
+/*
+ * Cohort mode: when a slice expires and fibers from the releasing fiber's
+ * cohort (same CPU or same NUMA node) are waiting, the next slice is reserved
+ * for them, up to cohort_budget consecutive slices. After that the lock is
+ * handed to another cohort with waiters. Cohort ids are folded into
+ * SCHED_LOCK_MAX_COHORTS counters.
+ */
+#ifndef SCHED_LOCK_MAX_COHORTS
+#define SCHED_LOCK_MAX_COHORTS 64
+#endif
+
+/*
+ * Adaptive slices: with config.adaptive set, the slice length tracks an EWMA
+ * of critical-section length (cs_per_slice sections per slice) and is clamped
+ * to [min_slice_ns, max_slice_ns]. While nobody is waiting for the lock,
+ * handoffs are free to skip, so the slice stretches to max_slice_ns.
+ * Otherwise the slice is fixed at SLICE_SIZE_US as before.
+ */
+#ifndef SCHED_LOCK_SLICE_HISTORY
+#define SCHED_LOCK_SLICE_HISTORY 64
+#endif
+
+/*
+ * Per-fiber state (ban and colour) is kept in a table inside the lock, so
+ * the acquire path does not go through libfiber's per-fiber lock records,
+ * whose cost grows with the number of locks a fiber has touched. A fiber
+ * claims a slot by CAS the first time it takes the lock; after that only that
+ * fiber reads or writes the slot. Lookups hash the fiber pointer and probe
+ * at most SCHED_LOCK_FIBER_PROBES slots. A fiber that finds no slot falls
+ * back to libfiber's lock data. Slots are not reclaimed when fibers exit, so
+ * size fiber_slots for the fibers that will ever use the lock.
+ */
+#ifndef SCHED_LOCK_FIBER_SLOTS
+#define SCHED_LOCK_FIBER_SLOTS 256
+#endif
+#ifndef SCHED_LOCK_FIBER_PROBES
+#define SCHED_LOCK_FIBER_PROBES 16
+#endif
+
+/*
+ * Lock-holder preemption avoidance. sched_lock_acquire() marks the worker
+ * thread as running a critical section and sched_lock_release() clears the
+ * mark. A preemptive (or migrating) fiber scheduler calls
+ * sched_lock_preempt_check() before switching the running fiber out
+ * involuntarily. While the mark is younger than SCHED_LOCK_PREEMPT_DEFER_NS it
+ * returns 1: the scheduler leaves the fiber running and the fiber yields at
+ * its outermost release instead. Past that bound it returns 0 and the switch
+ * goes ahead. When a fiber switches out voluntarily inside a critical section
+ * (waiting for a nested lock), its mark travels with it, since it may resume
+ * on another worker.
+ *
+ * The mark names the fiber it belongs to. A holder that blocks some other way
+ * (a fiber_mutex, I/O, sleeping) leaves its mark behind on the old worker;
+ * fibers that run there next ignore it, and the holder's own releases on the
+ * worker it resumes on find no mark of theirs and leave the depth alone. Such
+ * a holder just loses preemption avoidance until its outermost release.
+ */
+#ifndef SCHED_LOCK_PREEMPT_DEFER_NS
+#define SCHED_LOCK_PREEMPT_DEFER_NS (SLICE_SIZE_US * NSEC_PER_USEC)
+#endif
+
+struct sched_cs_mark {
+    uintptr_t fiber;      // fiber the mark belongs to
+    unsigned int depth;   // sched_lock critical sections that fiber is in
+    uint64_t since;       // now_ns() when the outermost one was entered
+    int yield_pending;    // a preemption was deferred; yield at the outermost release
+};
+
+struct sched_lock_preempt_stats {
+    uint64_t deferred;         // preemptions of a lock holder put off
+    uint64_t expired;          // preemptions let through after the bound
+    uint64_t forced_yields;    // yields at release owed to a deferral
+    uint64_t switched_in_cs;   // voluntary switches inside a critical section
+};
+
+extern __thread struct sched_cs_mark sched_cs_mark;
+extern _Atomic uint64_t sched_preempt_forced_yields;
+
+struct sched_lock_fiber {
+    atomic_uintptr_t fiber;   // 0 while the slot is free
+    uint64_t banned_until;    // ns, now_ns() clock
+    int coloured;             // set_fiber_colour() done since the last slice ended
+};
+
+struct sched_lock_config {
+    int adaptive;
+    uint64_t min_slice_ns;
+    uint64_t max_slice_ns;
+    unsigned int cs_per_slice;   // target critical sections per slice
+    unsigned int ewma_shift;     // each sample weighs 1/2^ewma_shift
+    unsigned int fiber_slots;    // per-fiber table size, rounded up to a power of two
+};
+
+#define SCHED_LOCK_CONFIG_DEFAULT {                 \
+    .adaptive     = 0,                              \
+    .min_slice_ns = 10 * NSEC_PER_USEC,             \
+    .max_slice_ns = 2000 * NSEC_PER_USEC,           \
+    .cs_per_slice = 32,                             \
+    .ewma_shift   = 3,                              \
+    .fiber_slots  = SCHED_LOCK_FIBER_SLOTS,         \
+}
+
+/* One entry per slice-length decision, oldest overwritten first. */
+struct sched_lock_slice_sample {
+    uint64_t when;       // now_ns() at the decision
+    uint64_t slice_ns;
+};
+
+struct sched_lock_slice_stats {
+    uint64_t slices;           // slices granted
+    uint64_t adjustments;      // decisions that changed slice_ns
+    uint64_t slice_ns;         // current slice length
+    uint64_t min_slice_ns;     // shortest / longest chosen so far
+    uint64_t max_slice_ns;
+    uint64_t cs_ewma_ns;       // EWMA of critical-section length
+    unsigned int waiters_x16;  // EWMA of waiting fibers, 4 fractional bits
+    struct sched_lock_slice_sample history[SCHED_LOCK_SLICE_HISTORY];
+};
+
+enum sched_cohort_level {
+    SCHED_COHORT_NONE = 0,
+    SCHED_COHORT_CPU,
+    SCHED_COHORT_NODE,
+};
+
+/* Per-critical-section timestamps are needed for adaptive slices and stats. */
+#ifdef LOCKSTAT
+#define SCHED_LOCK_TRACK_CS 1
+#else
+#define SCHED_LOCK_TRACK_CS 0
+#endif
+
 // static struct timeval inactive_threshold = {1, 0}; 
 
-struct sched_lock {
-    struct timeval start_ticks;
-    struct timeval end_ticks;
-    struct timeval slice_end_time;
+/*
+ * owner is the fiber that owns the current slice, or 0 when the lock is free.
+ * SCHED_LOCK_HELD is or-ed in while that fiber is inside a critical section.
+ * Between critical sections the owner keeps the slice and re-enters with a
+ * single CAS. Once the slice has expired and the owner is outside its
+ * critical section, a waiter may take the slice over, so an owner that stops
+ * using the lock cannot block it. The owner is banned for that slice then,
+ * as if it had released after expiry.
+ */
+#define SCHED_LOCK_HELD ((uintptr_t)1)
+
+/* Result of sched_lock_tryacquire() and sched_lock_acquire_until(). */
+enum sched_lock_status {
+    SCHED_LOCK_OK = 0,       // in the critical section
+    SCHED_LOCK_BUSY,         // tryacquire: another fiber holds the slice
+    SCHED_LOCK_BANNED,       // the caller's ban lasts past the deadline
+    SCHED_LOCK_TIMEDOUT,     // the slice was still held at the deadline
+};
+
+typedef struct sched_lock {
+    atomic_uintptr_t owner;
+    uint64_t start_ticks;     // ns, now_ns() clock
+    uint64_t end_ticks;
+    _Atomic uint64_t slice_end_time;
     // fiber_mutex_t mutex;
     // fiber_spinlock_t spinlock;
-    lock_stats_t* lock_stat;
     int slice_set;
 
-} sched_lock_t; 
+    int cohort_level;
+    unsigned int cohort_budget;
+    unsigned int cohort_slices;   // consecutive slices granted to cohort_id
+    int owner_cohort;
+    atomic_int cohort_id;         // cohort the free slice is reserved for, -1 if open
+    atomic_int waiting[SCHED_LOCK_MAX_COHORTS];
+
+    struct sched_lock_config config;
+    uint64_t slice_ns;            // adaptive mode: length of the next slice
+    uint64_t cs_start;            // start of the current critical section
+    uint64_t slice_cs_ns;         // domain only: critical-section time in this slice
+    struct sched_lock_slice_stats slice_stats;
+
+    struct sched_lock_fiber *fibers;
+    unsigned int fiber_bits;
+    struct sched_lock_fiber *owner_fiber;   // slot of the slice owner, NULL if it has none
+    struct lock_domain *domain;             // NULL unless set before the lock is shared
+    atomic_int cond_waiters;                // fibers parked in sched_lock_cond_wait()
+    LOCKSTAT_ONLY(struct lockstat stats;)
 
-void sched_lock_init(struct sched_lock *lock)
+} sched_lock_t;
+
+void sched_lock_init(struct sched_lock *lock);
+void sched_lock_init_config(struct sched_lock *lock, const struct sched_lock_config *config);
+void sched_lock_destroy(struct sched_lock *lock);
+void sched_lock_set_cohort(struct sched_lock *lock, int level, unsigned int budget);
+void sched_lock_set_domain(struct sched_lock *lock, struct lock_domain *domain);
+void sched_lock_get_slice_stats(struct sched_lock *lock, struct sched_lock_slice_stats *out);
+void sched_lock_get_preempt_stats(struct sched_lock_preempt_stats *out);
+int sched_lock_preempt_check(void);
+
+/* Slow paths and helpers shared with sched_rwlock (schedlock.c). */
+int sched_lock_acquire_slow(struct sched_lock *lock, uintptr_t self,
+                            struct sched_lock_fiber *me, uint64_t deadline);
+void sched_lock_expire(struct sched_lock *lock);
+void sched_lock_release_slice(struct sched_lock *lock);
+void sched_lock_yield(void);
+struct sched_cs_mark sched_cs_save(void);
+void sched_cs_restore(struct sched_cs_mark mark);
+void sched_lock_wait_ban(uint64_t banned_until);
+void ban_fibers(struct sched_lock *lock);
+
+/* Is fiber self inside a sched_lock critical section on this worker? */
+static inline int sched_cs_held(uintptr_t self)
 {
-    // fiber_mutex_init(&lock->spinlock);
-    lock->start_ticks = (struct timeval){0, 0};
-    lock->end_ticks = (struct timeval){0, 0};
-    lock->slice_end_time = (struct timeval){0, 0};
-    lock->slice_set = 0; // can be used to track is lock is held 
-    lock->lock_stat = malloc(sizeof(lock_stats_t));
-    lock->lock_stat->banned_until = (struct timeval){0, 0};
-    lock->lock_stat->slice_size = (struct timeval){0, 0};
+    return sched_cs_mark.fiber == self && sched_cs_mark.depth > 0;
 }
 
-void sched_lock_acquire(struct sched_lock *lock)
+/* Fiber self enters a critical section. A mark left behind by another fiber is replaced. */
+static inline void sched_cs_enter(uintptr_t self)
 {
-    // Colour if UnColoured and Record Lock.
-    set_fiber_colour((void*)lock, SLICE_SIZE_US);
-    
-    // Lock the underlying mutex.
-    // fiber_mutex_lock(&lock->mutex);
-    //fiber_spinlock_lock(&lock->spinlock);
-
-    if (lock->slice_set == 0){
-        // Record the start time.
-        gettimeofday(&lock->start_ticks, NULL);
-        
-        // Retrieve the fiber's lock statistics.
-        if (get_lock_fiber_data((void*)lock, lock->lock_stat) == 0){
-            printf("Error: No Stats, something is wrong.\n");
-            abort();
-        }
-        // Compute the slice end time.
-        timeval_add(&lock->slice_end_time, &lock->start_ticks, &lock->lock_stat->slice_size);
-        lock->slice_set = 1;
+    if (!sched_cs_held(self)) {
+        sched_cs_mark = (struct sched_cs_mark){ .fiber = self, .depth = 1, .since = now_ns() };
+        return;
     }
+    sched_cs_mark.depth++;
 }
 
-void sched_lock_release(struct sched_lock *lock)
+/*
+ * Fiber self leaves a critical section. Returns 1 if a deferred preemption is
+ * now due. Nothing to do if the mark is not here: self blocked inside the
+ * critical section without taking it along and resumed on another worker.
+ */
+static inline int sched_cs_exit(uintptr_t self)
 {
-    // We don't unset the colour and assume the thread can acquire this lock again 
-    // Lock Release Mechanism 
-    struct timeval time_adder;
-    struct timeval banned_until;
-    unsigned long long cs_length;
-    //fiber_spinlock_unlock(&lock->spinlock); // find a way for it to enter if a fiber holds a lock
-    // fiber_mutex_unlock(&lock->mutex);
-    gettimeofday(&lock->end_ticks, NULL); // we use the last possible end-ticks 
-    if (timercmp(&lock->end_ticks, &lock->slice_end_time,>)){ // enter if slice has expired
-        lock->slice_set = 0;
-        unset_colour(lock);
-        ban_fibers();
-        fiber_yield(); // Yield to Allow Others to get resources
-        return;
+    if (!sched_cs_held(self))
+        return 0;
+    if (--sched_cs_mark.depth > 0 || !sched_cs_mark.yield_pending)
+        return 0;
+    sched_cs_mark.yield_pending = 0;
+    atomic_fetch_add_explicit(&sched_preempt_forced_yields, 1, memory_order_relaxed);
+    return 1;
+}
+
+/* Fold one critical section into the EWMA. Called by the owner at release. */
+static inline void sched_lock_sample_cs(struct sched_lock *lock, uint64_t cs_length)
+{
+    struct sched_lock_slice_stats *st = &lock->slice_stats;
+    int64_t delta = (int64_t)cs_length - (int64_t)st->cs_ewma_ns;
+
+    if (st->cs_ewma_ns == 0)
+        st->cs_ewma_ns = cs_length;
+    else
+        st->cs_ewma_ns += delta / (1 << lock->config.ewma_shift);
+}
+
+/* Time left on a ban recorded in libfiber lock data (gettimeofday() time). */
+static inline uint64_t sched_ban_remaining(const lock_stats_t *stat)
+{
+    struct timeval wall;
+    uint64_t banned_until = timeval_to_ns(&stat->banned_until);
+    uint64_t now;
+
+    gettimeofday(&wall, NULL);
+    now = timeval_to_ns(&wall);
+    return banned_until > now ? banned_until - now : 0;
+}
+
+/* The calling fiber's slot in the lock's fiber table, claimed on first use. NULL if none is free. */
+static inline struct sched_lock_fiber *sched_lock_fiber(struct sched_lock *lock, uintptr_t self)
+{
+    size_t mask = ((size_t)1 << lock->fiber_bits) - 1;
+    size_t i = _hashmap_index(self, lock->fiber_bits);
+    uintptr_t key;
+    int n;
+
+    for (n = 0; n < SCHED_LOCK_FIBER_PROBES; n++, i = (i + 1) & mask) {
+        key = atomic_load_explicit(&lock->fibers[i].fiber, memory_order_acquire);
+        if (key == self)
+            return &lock->fibers[i];
+        if (key == 0 && atomic_compare_exchange_strong(&lock->fibers[i].fiber, &key, self))
+            return &lock->fibers[i];
     }
-    return;
+    return NULL;
 }
 
-void ban_fibers(struct sched_lock *lock){
-    int nthreads = get_fiber_count();
-    if (nthreads > 1) {
-        /* Expand ban tvime by (cs_length * num_threads). */
-        cs_length = time_diff(&lock->start_ticks, &lock->end_ticks);
-        time_adder.tv_sec  = (cs_length * (nthreads - 1 )) / 1000000ULL ;
-        time_adder.tv_usec = (cs_length * (nthreads - 1 )) % 1000000ULL ;
-
-        timeval_add(&banned_until, &lock->end_ticks, &time_adder);
-        set_lock_fiber_data((void*)lock, banned_until, (struct timeval){0,SLICE_SIZE_US}, NULL);
-        }
-     else {
-        /* If only one fiber, no ban needed. */
-        set_lock_fiber_data((void*)lock, lock->end_ticks, (struct timeval){0,SLICE_SIZE_US}, NULL);
+/* Enter a critical section on lock, waiting no later than deadline (now_ns() clock). */
+static inline int sched_lock_acquire_until(struct sched_lock *lock, uint64_t deadline)
+{
+    uintptr_t self = (uintptr_t)fiber_manager_get()->current_fiber;
+    uintptr_t expected = self;
+    struct sched_lock_fiber *me = sched_lock_fiber(lock, self);
+
+    // Colour if UnColoured and Record Lock.
+    if (!me || !me->coloured) {
+        set_fiber_colour((void*)lock, lock->slice_ns / NSEC_PER_USEC);
+        if (me)
+            me->coloured = 1;
+    }
+
+    // Re-entering within our own slice costs a single CAS.
+    if (__builtin_expect(atomic_compare_exchange_strong(&lock->owner, &expected,
+                                                        self | SCHED_LOCK_HELD), 1)) {
+        if (SCHED_LOCK_TRACK_CS || lock->config.adaptive || lock->domain)
+            lock->cs_start = now_ns();
+        sched_cs_enter(self);
+        LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, self, 0);)
+        return SCHED_LOCK_OK;
     }
+    return sched_lock_acquire_slow(lock, self, me, deadline);
 }
 
+/* Enter a critical section only if that needs no waiting, for a slice or for a ban. */
+static inline int sched_lock_tryacquire(struct sched_lock *lock)
+{
+    return sched_lock_acquire_until(lock, now_ns());
+}
+
+static inline void sched_lock_acquire(struct sched_lock *lock)
+{
+    sched_lock_acquire_until(lock, UINT64_MAX);
+}
+
+/* Close the critical section's books. Returns 1 if a deferred preemption is now due. */
+static inline int sched_lock_leave_cs(struct sched_lock *lock)
+{
+    int yield_due = sched_cs_exit(atomic_load_explicit(&lock->owner, memory_order_relaxed) &
+                                  ~SCHED_LOCK_HELD);
+
+    lock->end_ticks = now_ns(); // we use the last possible end-ticks 
+    if (lock->config.adaptive)
+        sched_lock_sample_cs(lock, lock->end_ticks - lock->cs_start);
+    if (lock->domain)
+        lock->slice_cs_ns += lock->end_ticks - lock->cs_start;
+    LOCKSTAT_ONLY(lockstat_released(&lock->stats, lock->end_ticks - lock->cs_start);)
+    return yield_due;
+}
+
+static inline void sched_lock_release(struct sched_lock *lock)
+{
+    // We don't unset the colour and assume the thread can acquire this lock again 
+    int yield_due = sched_lock_leave_cs(lock);
+
+    if (lock->end_ticks > atomic_load(&lock->slice_end_time)){ // enter if slice has expired
+        sched_lock_expire(lock);
+        return;
+    }
+    // Keep the slice, but leave the critical section.
+    atomic_store(&lock->owner, atomic_load(&lock->owner) & ~SCHED_LOCK_HELD);
+    if (yield_due)
+        fiber_yield(); // Take the preemption we put off
+    return;
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -1,16 +1,40 @@
 #ifndef _TIMING_H_
 #define _TIMING_H_
 
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
 
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_SEC  1000000000ULL
 
-unsigned long long  time_diff(struct timeval *t0, struct timeval *t1) {
+/*
+ * Lock timestamps are uint64_t nanoseconds taken from now_ns().
+ *
+ * On x86 the clock is the TSC scaled by a 32.32 fixed-point ns-per-cycle
+ * multiplier. The multiplier is seeded from CYCLE_PER_US (set in the Makefile)
+ * and can be replaced by a measured value with timing_calibrate(). Without
+ * CYCLE_PER_US the first now_ns() call calibrates. Build with -DTIMING_NO_TSC
+ * (or on other architectures) to fall back to CLOCK_MONOTONIC_RAW.
+ *
+ * Build with -DTIMING_SIMULATED for a virtual clock instead: now_ns() returns
+ * timing_sim_ns, which only moves when the program sets or advances it, so
+ * runs are deterministic and independent of CYCLE_PER_US (see
+ * bench/fairness_sim.c).
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(TIMING_NO_TSC) && \
+    !defined(TIMING_SIMULATED)
+#define TIMING_USE_TSC 1
+#endif
+
+#define TIMING_CALIBRATE_NS (10ULL * 1000000ULL) // 10ms calibration window
+
+static inline unsigned long long time_diff(struct timeval *t0, struct timeval *t1) {
     return (unsigned long long  )((t1->tv_sec - t0->tv_sec) * 1000000 + (t1->tv_usec - t0->tv_usec));
 }
 
 
-void timeval_add(struct timeval *result, const struct timeval *t1, const struct timeval *t2) {
+static inline void timeval_add(struct timeval *result, const struct timeval *t1, const struct timeval *t2) {
     result->tv_sec = t1->tv_sec + t2->tv_sec;
     result->tv_usec = t1->tv_usec + t2->tv_usec;
 
@@ -20,4 +44,97 @@ void timeval_add(struct timeval *result, const struct timeval *t1, const struct
     }
 }
 
-#endif
\ No newline at end of file
+static inline uint64_t clock_raw_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t timeval_to_ns(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * NSEC_PER_SEC + (uint64_t)tv->tv_usec * NSEC_PER_USEC;
+}
+
+static inline struct timeval ns_to_timeval(uint64_t ns)
+{
+    struct timeval tv;
+
+    tv.tv_sec  = ns / NSEC_PER_SEC;
+    tv.tv_usec = (ns % NSEC_PER_SEC) / NSEC_PER_USEC;
+    return tv;
+}
+
+#if defined(TIMING_SIMULATED)
+
+/* Virtual time in ns (timing.c). */
+extern uint64_t timing_sim_ns;
+
+static inline void timing_calibrate(void) {}
+
+static inline uint64_t now_ns(void)
+{
+    return timing_sim_ns;
+}
+
+static inline void timing_sim_set(uint64_t ns)
+{
+    timing_sim_ns = ns;
+}
+
+static inline void timing_sim_advance(uint64_t ns)
+{
+    timing_sim_ns += ns;
+}
+
+#elif defined(TIMING_USE_TSC)
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* ns per TSC cycle, 32.32 fixed point; shared by every user of the clock (timing.c). */
+extern uint64_t tsc_ns_mult;
+
+/* Measure the TSC rate against CLOCK_MONOTONIC_RAW and use it from now on. */
+void timing_calibrate(void);
+
+static inline uint64_t now_ns(void)
+{
+    if (__builtin_expect(tsc_ns_mult == 0, 0))
+        timing_calibrate();
+    return (uint64_t)(((unsigned __int128)rdtsc() * tsc_ns_mult) >> 32);
+}
+
+#else
+
+static inline void timing_calibrate(void) {}
+
+static inline uint64_t now_ns(void)
+{
+    return clock_raw_ns();
+}
+
+#endif /* TIMING_SIMULATED / TIMING_USE_TSC */
+
+/*
+ * Convert a now_ns() deadline into a gettimeofday() timeval, for state that
+ * is shared with code still working in wall-clock time (libfiber lock data).
+ */
+static inline struct timeval ns_deadline_to_timeval(uint64_t deadline_ns)
+{
+    struct timeval wall;
+    uint64_t now = now_ns();
+
+    gettimeofday(&wall, NULL);
+    if (deadline_ns <= now)
+        return wall;
+    return ns_to_timeval(timeval_to_ns(&wall) + (deadline_ns - now));
+}
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "fiber_manager.h"
+#include "fiber_cond.h"
+#include "fiber_io.h"
+#include "banqueue.h"
+
+#define BAN_QUEUE_INITIAL_CAPACITY 64
+#define BAN_QUEUE_TIMER_STACK      16384
+
+/* A parked fiber; lives on its stack until woken. */
+struct ban_waiter {
+    uint64_t until;
+    int woken;
+    fiber_cond_t cond;
+};
+
+struct ban_queue {
+    fiber_mutex_t mutex;
+    struct ban_waiter **heap;   // min-heap on until
+    size_t count;
+    size_t capacity;
+    fiber_cond_t timer_cond;    // the timer waits here while the heap is empty
+    int timer_idle;
+    int stop;
+    fiber_t *timer;
+    struct ban_queue_stats stats;
+};
+
+_Atomic uint64_t ban_queue_next = UINT64_MAX;
+atomic_int ban_queue_nfibers;
+
+static struct ban_queue bq;
+static pthread_once_t bq_once = PTHREAD_ONCE_INIT;
+
+static void ban_queue_publish_locked(void)
+{
+    atomic_store_explicit(&ban_queue_next, bq.count ? bq.heap[0]->until : UINT64_MAX,
+                          memory_order_release);
+}
+
+static void ban_queue_push_locked(struct ban_waiter *w)
+{
+    struct ban_waiter **heap;
+    size_t i, parent;
+
+    if (bq.count == bq.capacity) {
+        heap = realloc(bq.heap, bq.capacity * 2 * sizeof(*heap));
+        if (!heap) {
+            fprintf(stderr, "Error: Unable to grow ban queue\n");
+            exit(EXIT_FAILURE);
+        }
+        bq.heap = heap;
+        bq.capacity *= 2;
+    }
+    for (i = bq.count++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (bq.heap[parent]->until <= w->until)
+            break;
+        bq.heap[i] = bq.heap[parent];
+    }
+    bq.heap[i] = w;
+}
+
+static struct ban_waiter *ban_queue_pop_locked(void)
+{
+    struct ban_waiter *top = bq.heap[0];
+    struct ban_waiter *last = bq.heap[--bq.count];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < bq.count) {
+        if (child + 1 < bq.count && bq.heap[child + 1]->until < bq.heap[child]->until)
+            child++;
+        if (last->until <= bq.heap[child]->until)
+            break;
+        bq.heap[i] = bq.heap[child];
+        i = child;
+    }
+    if (bq.count > 0)
+        bq.heap[i] = last;
+    return top;
+}
+
+/* Wake every waiter whose ban is over. Caller holds the mutex. */
+static void ban_queue_expire_locked(uint64_t now, int from_timer)
+{
+    struct ban_waiter *w;
+
+    while (bq.count > 0 && bq.heap[0]->until <= now) {
+        w = ban_queue_pop_locked();
+        bq.stats.late_ns += now - w->until;
+        if (from_timer)
+            bq.stats.woken_by_timer++;
+        else
+            bq.stats.woken_by_poll++;
+        w->woken = 1;
+        fiber_cond_signal(&w->cond);
+    }
+    ban_queue_publish_locked();
+}
+
+static void *ban_queue_timer(void *param)
+{
+    uint64_t now, wait;
+
+    fiber_mutex_lock(&bq.mutex);
+    while (!bq.stop) {
+        if (bq.count == 0) {
+            bq.timer_idle = 1;
+            fiber_cond_wait(&bq.timer_cond, &bq.mutex);
+            bq.timer_idle = 0;
+            continue;
+        }
+        now = now_ns();
+        ban_queue_expire_locked(now, 1);
+        if (bq.count == 0)
+            continue;
+
+        wait = bq.heap[0]->until - now;
+        if (wait > BAN_QUEUE_TICK_NS)
+            wait = BAN_QUEUE_TICK_NS;
+        fiber_mutex_unlock(&bq.mutex);
+        if (wait >= NSEC_PER_USEC)
+            fiber_sleep(0, wait / NSEC_PER_USEC);
+        else
+            fiber_yield();
+        fiber_mutex_lock(&bq.mutex);
+    }
+    fiber_mutex_unlock(&bq.mutex);
+    return NULL;
+}
+
+static void ban_queue_init(void)
+{
+    fiber_mutex_init(&bq.mutex);
+    fiber_cond_init(&bq.timer_cond);
+    bq.heap = malloc(BAN_QUEUE_INITIAL_CAPACITY * sizeof(*bq.heap));
+    if (!bq.heap) {
+        fprintf(stderr, "Error: Unable to allocate ban queue\n");
+        exit(EXIT_FAILURE);
+    }
+    bq.capacity = BAN_QUEUE_INITIAL_CAPACITY;
+    atomic_store(&ban_queue_nfibers, 1);
+    bq.timer = fiber_create(BAN_QUEUE_TIMER_STACK, &ban_queue_timer, NULL);
+    if (!bq.timer) {
+        fprintf(stderr, "Error: Unable to start the ban timer fiber\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Wait until banned_until (now_ns() clock) without occupying a worker. */
+void ban_queue_wait(uint64_t banned_until)
+{
+    struct ban_waiter w;
+    uint64_t now = now_ns();
+
+    if (banned_until <= now)
+        return;
+    if (banned_until - now < BAN_QUEUE_PARK_MIN_NS) {
+        while (now_ns() < banned_until) {
+            fiber_yield();
+        }
+        return;
+    }
+
+    pthread_once(&bq_once, ban_queue_init);
+    w.until = banned_until;
+    w.woken = 0;
+    fiber_cond_init(&w.cond);
+
+    fiber_mutex_lock(&bq.mutex);
+    ban_queue_push_locked(&w);
+    bq.stats.parked++;
+    ban_queue_publish_locked();
+    if (bq.timer_idle)
+        fiber_cond_signal(&bq.timer_cond);
+    while (!w.woken) {
+        fiber_cond_wait(&w.cond, &bq.mutex);
+    }
+    fiber_mutex_unlock(&bq.mutex);
+    fiber_cond_destroy(&w.cond);
+}
+
+/* ban_queue_poll() found an expired ban. Skip if someone else is already at it. */
+void ban_queue_drain(void)
+{
+    if (!fiber_mutex_trylock(&bq.mutex))
+        return;
+    ban_queue_expire_locked(now_ns(), 0);
+    fiber_mutex_unlock(&bq.mutex);
+}
+
+void ban_queue_get_stats(struct ban_queue_stats *out)
+{
+    pthread_once(&bq_once, ban_queue_init);
+    fiber_mutex_lock(&bq.mutex);
+    *out = bq.stats;
+    fiber_mutex_unlock(&bq.mutex);
+}
+
+/* Stop the timer fiber. No fiber may be banned or become banned afterwards. */
+void ban_queue_shutdown(void)
+{
+    pthread_once(&bq_once, ban_queue_init);
+    fiber_mutex_lock(&bq.mutex);
+    bq.stop = 1;
+    fiber_cond_signal(&bq.timer_cond);
+    fiber_mutex_unlock(&bq.mutex);
+    fiber_join(bq.timer, NULL);
+    atomic_store(&ban_queue_nfibers, 0);
+}
@@ -0,0 +1,649 @@
+#include <stdio.h>                  
+#include <stdbool.h>        
+#include <stdatomic.h>           
+#include "hashmap.h"       
+#include "list.h"           
+#include "timing.h"         
+#include "fiber_manager.h"  
+#include "fiber_io.h"
+#include "fairlock.h"       
+
+
+
+static inline struct fairlock_waiter *alloc_waiter(struct fairlock *lock)
+{
+    struct fairlock_waiter *waiter;
+
+    if (!list_empty(&lock->free_waiters)) {
+        waiter = list_first_entry(&lock->free_waiters, struct fairlock_waiter, list);
+        list_del(&waiter->list);
+        return waiter;
+    }
+    return (struct fairlock_waiter *)malloc(sizeof(*waiter));
+}
+
+static inline void free_waiter(struct fairlock *lock, struct fairlock_waiter *waiter)
+{
+    if (waiter >= lock->pool && waiter < lock->pool + lock->pool_capacity) {
+        list_add(&waiter->list, &lock->free_waiters);
+    } else {
+        free(waiter);
+    }
+}
+
+/* Change a tracked waiter's weight. Caller holds the ticket. */
+static inline void set_waiter_weight(struct fairlock *lock, struct fairlock_waiter *waiter,
+                                     unsigned int weight)
+{
+    lock->total_weight += weight;
+    lock->total_weight -= waiter->weight;
+    if (waiter->cond_parked)
+        lock->cond_weight += weight - waiter->weight;
+    waiter->weight = weight;
+}
+
+static inline struct fairlock_waiter *create_waiter(struct fairlock *lock, int fid_c,
+                                                    unsigned int weight)
+{
+    struct fairlock_waiter *waiter;
+    uint64_t now = now_ns();
+
+    waiter = alloc_waiter(lock);
+    if (!waiter) {
+        fprintf(stderr, "Error: Unable to allocate fairlock_waiter\n");
+        return NULL;
+    }
+
+    /* A sole user skips its timestamps (see fair_unlock()); settle them now it has company. */
+    if (atomic_load(&lock->num_threads) == 1 && lock->holder) {
+        lock->holder->end_ticks = now;
+        lock->holder->banned_until = now;
+    }
+
+    waiter->fid          = fid_c;
+    waiter->banned_until = now;
+    waiter->start_ticks  = now;
+    waiter->end_ticks    = now;
+    waiter->weight       = fairlock_weight(weight);
+    waiter->cond_parked  = 0;
+    if (hashmap_put(&lock->waiters_lookup, (uintptr_t)fid_c, waiter) != 0) {
+        fprintf(stderr, "Error: Unable to grow fairlock waiter table\n");
+        free_waiter(lock, waiter);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&waiter->list);
+    list_add_tail(&waiter->list, &lock->waiters); // adding the waiters node from lock 
+    atomic_fetch_add(&lock->num_threads, 1);
+    lock->total_weight += waiter->weight;
+    return waiter;
+}
+
+static inline struct fairlock_waiter *retrieve_waiter(struct fairlock *lock, int fid)
+{
+    return (struct fairlock_waiter *)hashmap_get(&lock->waiters_lookup, (uintptr_t)fid);
+}
+
+/* Has my_ticket been granted? Queue mode only reads the ticket's own slot. */
+static inline int fairlock_granted(struct fairlock *lock, struct fairlock_park_slot *slot,
+                                   unsigned int my_ticket)
+{
+    if (lock->mode == FAIRLOCK_QUEUE)
+        return atomic_load(&slot->turn) == my_ticket;
+    return atomic_load(&lock->now_serving) == my_ticket;
+}
+
+/*
+ * Wait until my_ticket is granted: spin briefly, then park on the ticket's
+ * slot. parked is raised under the slot mutex before the grant is re-checked,
+ * so fairlock_pass() either sees it or we see the new ticket.
+ */
+static inline void fairlock_wait_turn(struct fairlock *lock, unsigned int my_ticket)
+{
+    struct fairlock_park_slot *slot = &lock->park[my_ticket % FAIRLOCK_PARK_SLOTS];
+    int spins;
+
+    for (spins = 0; spins < FAIRLOCK_SPIN_LIMIT; spins++) {
+        if (fairlock_granted(lock, slot, my_ticket))
+            return;
+    }
+
+    fiber_mutex_lock(&slot->mutex);
+    atomic_fetch_add(&slot->parked, 1);
+    while (!fairlock_granted(lock, slot, my_ticket)) {
+        fiber_cond_wait(&slot->cond, &slot->mutex);
+    }
+    atomic_fetch_sub(&slot->parked, 1);
+    fiber_mutex_unlock(&slot->mutex);
+}
+
+/* Sit out a ban parked in the ban queue, off the run queue. */
+static inline void fairlock_wait_ban(uint64_t banned_until)
+{
+    ban_queue_wait(banned_until);
+}
+
+/*
+ * Publish waiter's ban for fibers that do not hold the ticket. Caller holds
+ * the ticket, which makes it the only writer.
+ */
+static inline void fairlock_publish_ban(struct fairlock *lock, struct fairlock_waiter *waiter)
+{
+    struct fairlock_ban_slot *slot =
+        &lock->bans[(unsigned int)waiter->fid & (FAIRLOCK_BAN_SLOTS - 1)];
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->fid, waiter->fid, memory_order_relaxed);
+    atomic_store_explicit(&slot->banned_until, waiter->banned_until, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Sit out fid's published ban, if any, so it is not discovered under a
+ * ticket, and then the calling fiber's domain ban.
+ */
+static inline void fairlock_wait_published_ban(struct fairlock *lock, int fid)
+{
+    uint64_t ban = fairlock_ban_hint(lock, fid);
+
+    if (ban > now_ns())
+        fairlock_wait_ban(ban);
+    if (lock->domain) {
+        ban = lock_domain_ban(lock->domain, (uintptr_t)fiber_manager_get()->current_fiber);
+        if (ban)
+            fairlock_wait_ban(ban);
+    }
+}
+
+/* Mark a waiter as most recently used by moving it to the tail of the list. */
+static inline void touch_waiter(struct fairlock *lock, struct fairlock_waiter *waiter)
+{
+    list_move_tail(&waiter->list, &lock->waiters);
+}
+
+/*
+ * Drop waiters idle for longer than inactive_threshold_ns. Only the LRU head
+ * is examined, and at most FAIRLOCK_REAP_BUDGET entries per call, so the cost
+ * of an unlock does not grow with the number of fibers the lock has seen.
+ */
+static inline void fairlock_reap(struct fairlock *lock, uint64_t now)
+{
+    struct fairlock_waiter *oldest;
+    int budget;
+
+    for (budget = 0; budget < FAIRLOCK_REAP_BUDGET; budget++) {
+        if (list_empty(&lock->waiters))
+            break;
+
+        oldest = list_first_entry(&lock->waiters, struct fairlock_waiter, list);
+        if (oldest == lock->holder ||
+            oldest->end_ticks + lock->inactive_threshold_ns >= now)
+            break;
+
+        /* Remove from list & hashtable, then recycle. */
+        list_del(&oldest->list);
+        hashmap_del(&lock->waiters_lookup, (uintptr_t)oldest->fid);
+        lock->total_weight -= oldest->weight;
+        if (oldest->cond_parked) {
+            lock->cond_parked--;
+            lock->cond_weight -= oldest->weight;
+        }
+        free_waiter(lock, oldest);
+        atomic_fetch_sub(&lock->num_threads, 1);
+    }
+}
+
+void fairlock_init(struct fairlock *lock)
+{
+    fairlock_init_capacity(lock, FAIRLOCK_POOL_CAPACITY);
+}
+
+void fairlock_init_capacity(struct fairlock *lock, unsigned int capacity)
+{
+    unsigned int i;
+
+    if (hashmap_init(&lock->waiters_lookup, FAIRLOCK_LOOKUP_BITS) != 0) {
+        fprintf(stderr, "Error: Unable to allocate fairlock waiter table\n");
+        exit(EXIT_FAILURE);
+    }
+    INIT_LIST_HEAD(&lock->waiters);
+
+    atomic_init(&lock->num_threads, 0);
+    lock->domain = NULL;
+    lock->total_weight = 0;
+    lock->cond_parked = 0;
+    lock->cond_weight = 0;
+    atomic_init(&lock->next_ticket, 0);
+    atomic_init(&lock->now_serving, 0);
+    atomic_init(&lock->combine_head, NULL);
+
+    lock->mode = FAIRLOCK_TICKET;
+    lock->holder = NULL;
+    lock->combine_deferred = NULL;
+    lock->combine_deferred_last = NULL;
+    lock->inactive_threshold_ns = FAIRLOCK_INACTIVE_THRESHOLD_NS;
+
+    INIT_LIST_HEAD(&lock->free_waiters);
+    lock->pool = NULL;
+    lock->pool_capacity = 0;
+    if (capacity > 0) {
+        lock->pool = (struct fairlock_waiter *)malloc(capacity * sizeof(*lock->pool));
+        if (!lock->pool) {
+            fprintf(stderr, "Error: Unable to allocate fairlock waiter pool\n");
+        } else {
+            lock->pool_capacity = capacity;
+            for (i = 0; i < capacity; i++) {
+                list_add_tail(&lock->pool[i].list, &lock->free_waiters);
+            }
+        }
+    }
+
+    LOCKSTAT_ONLY(lockstat_register(&lock->stats, "fairlock", lock);)
+
+    for (i = 0; i < FAIRLOCK_PARK_SLOTS; i++) {
+        fiber_mutex_init(&lock->park[i].mutex);
+        fiber_cond_init(&lock->park[i].cond);
+        /* Ticket 0 is granted up front; every other slot waits for a pass. */
+        atomic_init(&lock->park[i].turn, i == 0 ? 0 : (unsigned int)-1);
+        atomic_init(&lock->park[i].parked, 0);
+    }
+    for (i = 0; i < FAIRLOCK_BAN_SLOTS; i++) {
+        atomic_init(&lock->bans[i].seq, 0);
+        atomic_init(&lock->bans[i].fid, -1);
+        atomic_init(&lock->bans[i].banned_until, 0);
+    }
+}
+
+/* Select how waiters poll for their turn; call before the lock is shared. */
+void fairlock_set_mode(struct fairlock *lock, enum fairlock_mode mode)
+{
+    lock->mode = mode;
+}
+
+void fairlock_set_inactive_threshold(struct fairlock *lock, uint64_t threshold_ns)
+{
+    lock->inactive_threshold_ns = threshold_ns;
+}
+
+/* Charge holds of this lock to domain as well; call before the lock is shared. */
+void fairlock_set_domain(struct fairlock *lock, struct lock_domain *domain)
+{
+    lock->domain = domain;
+}
+
+/*
+ * Give fid a new weight, taking a ticket to do so. Takes effect from the
+ * fiber's next ban; fair_lock_weighted() does the same without a separate
+ * handoff.
+ */
+void fairlock_set_weight(struct fairlock *lock, int fid, unsigned int weight)
+{
+    struct fairlock_waiter *waiter;
+    unsigned int my_ticket;
+
+    my_ticket = atomic_fetch_add(&lock->next_ticket, 1);
+    fairlock_wait_turn(lock, my_ticket);
+
+    waiter = retrieve_waiter(lock, fid);
+    if (waiter)
+        set_waiter_weight(lock, waiter, fairlock_weight(weight));
+    else if (!create_waiter(lock, fid, weight))
+        fprintf(stderr, "Error: Unable to record fairlock weight for fid %d\n", fid);
+
+    fairlock_pass(lock);
+}
+
+void fairlock_destroy(struct fairlock *lock)
+{
+    unsigned int end_ticket;
+    struct fairlock_waiter *waiter, *tmp;
+    int i;
+
+    /*
+     * Grab the next_ticket value. This increments next_ticket by 1
+     * and returns the old value. We store it in end_ticket.
+     */
+    end_ticket = atomic_fetch_add(&lock->next_ticket, 1);
+
+    /* Wait until now_serving catches up (i.e., all waiters done). */
+    fairlock_wait_turn(lock, end_ticket);
+
+    list_for_each_entry_safe(waiter, tmp, &lock->waiters, list) {
+        list_del(&waiter->list);
+        free_waiter(lock, waiter);
+    }
+    hashmap_destroy(&lock->waiters_lookup);
+    LOCKSTAT_ONLY(lockstat_unregister(&lock->stats);)
+    free(lock->pool);
+    lock->pool = NULL;
+    lock->pool_capacity = 0;
+    INIT_LIST_HEAD(&lock->free_waiters);
+
+    for (i = 0; i < FAIRLOCK_PARK_SLOTS; i++) {
+        fiber_cond_destroy(&lock->park[i].cond);
+        fiber_mutex_destroy(&lock->park[i].mutex);
+    }
+}
+
+int fair_trylock(struct fairlock *lock, int fid)
+{
+    struct fairlock_waiter *waiter;
+
+    /* A published ban fails at once, without touching the ticket. */
+    if (atomic_load_explicit(&lock->num_threads, memory_order_relaxed) > 1 &&
+        fairlock_ban_hint(lock, fid) > now_ns())
+        return 0;
+    if (lock->domain &&
+        lock_domain_ban(lock->domain, (uintptr_t)fiber_manager_get()->current_fiber))
+        return 0;
+
+    /* Take a ticket only if it would be served at once. */
+    if (!fairlock_try_ticket(lock))
+        return 0;
+
+    waiter = retrieve_waiter(lock, fid);
+    
+    if (!waiter) {
+        /* No existing waiter => create one */
+        waiter = create_waiter(lock, fid, 0);
+        if (!waiter) {
+            return 0;
+        }
+    } else {
+        /* The waiter already exists => check if it's still banned. */
+        uint64_t cur_time = now_ns();
+
+        if (waiter->end_ticks < waiter->banned_until &&
+            cur_time < waiter->banned_until) {
+            /* The waiter is banned until some future time => yield lock. */
+            LOCKSTAT_ONLY(lockstat_ban_requeue(&lock->stats);)
+            fairlock_pass(lock);
+            return 0;
+        }
+        /* Otherwise, we can start a new critical section. */
+        waiter->start_ticks = cur_time;
+        touch_waiter(lock, waiter);
+    }
+
+    lock->holder = waiter;
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, (uintptr_t)fid, 0);)
+    return 1; /* Successfully acquired */
+}
+
+/* --------------------------------------------------------------------------
+ * fair_lock_slow
+ *
+ * Blocking version of fair_lock_weighted(): we sit out any published ban,
+ * then spin, then park, until it's our ticket (unless the fast path already
+ * holds it), then re-check ban if needed. A non-zero weight replaces the
+ * fiber's own.
+ * -------------------------------------------------------------------------- */
+void fair_lock_slow(struct fairlock *lock, int fid, unsigned int weight, int have_ticket)
+{
+    unsigned int my_ticket;
+    struct fairlock_waiter *waiter;
+    LOCKSTAT_ONLY(uint64_t wait_start = now_ns();)
+
+    if (!have_ticket) {
+        fairlock_wait_published_ban(lock, fid);
+
+        /*Become the next waiting thread to get the lock */
+        my_ticket = atomic_fetch_add(&lock->next_ticket, 1);
+
+        /* Spin, then park, until its our turn to get lock */
+        fairlock_wait_turn(lock, my_ticket);
+    }
+
+    /* Now we hold the lock from a ticket perspective. */
+    waiter = retrieve_waiter(lock, fid);
+
+    if (!waiter) {
+        /*Create a new Waiter struct, and give this fiber the lock*/
+        waiter = create_waiter(lock, fid, weight);
+        if (!waiter) {
+            fprintf(stderr, "Unable to allocate memory for fairlock waiter\n");
+            exit(EXIT_FAILURE);
+        }
+        lock->holder = waiter;
+    } else {
+        /* The waiter stuct for the fiber already exists, check if it's still banned. */
+        uint64_t cur_time = now_ns();
+
+        if (waiter->end_ticks < waiter->banned_until &&
+            cur_time < waiter->banned_until) {
+            /* Banned, but its slot was held by another fid => let us serve other threads*/
+            LOCKSTAT_ONLY(lockstat_ban_requeue(&lock->stats);)
+            fairlock_pass(lock);
+
+            fairlock_wait_ban(waiter->banned_until);
+
+            /* Re-acquire a new ticket once ban is lifted. */
+            my_ticket = atomic_fetch_add(&lock->next_ticket, 1);
+            fairlock_wait_turn(lock, my_ticket);
+        }
+        /* Ban time has been served so we can get the lock */
+        if (weight != 0 && fairlock_weight(weight) != waiter->weight)
+            set_waiter_weight(lock, waiter, fairlock_weight(weight));
+        waiter->start_ticks = now_ns();
+        touch_waiter(lock, waiter);
+        lock->holder = waiter;
+    }
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, (uintptr_t)fid, waiter->start_ticks - wait_start);)
+}
+
+/*
+ * End waiter's critical section at now and charge it, and the fiber that
+ * submitted it to the lock's domain. Caller holds the ticket.
+ */
+static inline void fairlock_charge(struct fairlock *lock, struct fairlock_waiter *waiter,
+                                   uintptr_t fiber, uint64_t now)
+{
+    unsigned int num_threads;
+    uint64_t cs_length;
+
+    if (lock->domain)
+        lock_domain_charge(lock->domain, fiber, now - waiter->start_ticks, now);
+    waiter->end_ticks = now;
+    LOCKSTAT_ONLY(lockstat_released(&lock->stats, now - waiter->start_ticks);)
+    /* Fibers parked on a lock_cond are not competing for the lock. */
+    num_threads = atomic_load(&lock->num_threads) - lock->cond_parked;
+    if (num_threads > 1) {
+        /* Expand ban time by cs_length * total_weight / weight (cs_length * num_threads when equal). */
+        cs_length = now - waiter->start_ticks;
+        waiter->banned_until += (uint64_t)((unsigned __int128)cs_length *
+                                           (lock->total_weight - lock->cond_weight) /
+                                           waiter->weight);
+        LOCKSTAT_ONLY(if (waiter->banned_until > now)
+                          lockstat_banned(&lock->stats, waiter->banned_until - now);)
+
+        /* Clean up a bounded number of inactive waiters. */
+        fairlock_reap(lock, now);
+    } else {
+        /* If only one fiber, no ban needed. */
+        waiter->banned_until = now;
+    }
+    fairlock_publish_ban(lock, waiter);
+}
+
+/* fair_unlock() when other fibers share the lock: charge the holder a ban. */
+void fair_unlock_slow(struct fairlock *lock)
+{
+    fairlock_charge(lock, lock->holder, (uintptr_t)fiber_manager_get()->current_fiber, now_ns());
+    /* Move to next waiter */
+    LOCKSTAT_ONLY(if ((unsigned int)atomic_load(&lock->next_ticket) !=
+                      (unsigned int)atomic_load(&lock->now_serving) + 1)
+                      lockstat_handoff(&lock->stats);)
+    fairlock_pass(lock);
+}
+
+/*
+ * fair_unlock() for a fiber about to wait on a lock_cond: its section is
+ * charged as usual, then it is left out of other fibers' bans until
+ * fairlock_cond_return().
+ */
+void fair_unlock_cond(struct fairlock *lock)
+{
+    struct fairlock_waiter *waiter = lock->holder;
+
+    if (atomic_load(&lock->num_threads) > 1 || lock->domain) {
+        fairlock_charge(lock, waiter, (uintptr_t)fiber_manager_get()->current_fiber, now_ns());
+    } else {
+        LOCKSTAT_ONLY(lockstat_released(&lock->stats, now_ns() - waiter->start_ticks);)
+    }
+    waiter->cond_parked = 1;
+    lock->cond_parked++;
+    lock->cond_weight += waiter->weight;
+    fairlock_pass(lock);
+}
+
+/* Count the holder back in after a lock_cond wait. A reaped waiter was already counted out. */
+void fairlock_cond_return(struct fairlock *lock)
+{
+    struct fairlock_waiter *waiter = lock->holder;
+
+    if (!waiter->cond_parked)
+        return;
+    waiter->cond_parked = 0;
+    lock->cond_parked--;
+    lock->cond_weight -= waiter->weight;
+}
+
+/* Push the chain first..last onto the combining list. */
+static inline void fairlock_push_requests(struct fairlock *lock, struct fairlock_request *first,
+                                          struct fairlock_request *last)
+{
+    struct fairlock_request *head = atomic_load(&lock->combine_head);
+
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak(&lock->combine_head, &head, first));
+}
+
+/*
+ * Run queued sections in submission order, charging each to its submitter.
+ * Sections skipped in earlier batches come first, then the newly submitted
+ * ones. Banned submitters, and anything past FAIRLOCK_COMBINE_BATCH, are
+ * kept on lock->combine_deferred in the same order. Caller holds the ticket.
+ */
+static inline void fairlock_combine_batch(struct fairlock *lock)
+{
+    struct fairlock_request *list, *req, *next, *fresh = NULL, *run;
+    struct fairlock_request *deferred = NULL, *deferred_last = NULL;
+    struct fairlock_waiter *waiter;
+    uint64_t now;
+    int served = 0;
+
+    list = atomic_exchange(&lock->combine_head, NULL);
+    while (list) {
+        next = list->next;
+        list->next = fresh;
+        fresh = list;
+        list = next;
+    }
+    run = fresh;
+    if (lock->combine_deferred) {
+        lock->combine_deferred_last->next = fresh;
+        run = lock->combine_deferred;
+    }
+
+    while (run) {
+        req = run;
+        run = req->next;
+
+        waiter = NULL;
+        if (served < FAIRLOCK_COMBINE_BATCH) {
+            waiter = retrieve_waiter(lock, req->fid);
+            if (!waiter) {
+                waiter = create_waiter(lock, req->fid, req->weight);
+                if (!waiter) {
+                    fprintf(stderr, "Unable to allocate memory for fairlock waiter\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            now = now_ns();
+            if (waiter->end_ticks < waiter->banned_until && now < waiter->banned_until) {
+                atomic_store(&req->banned_until, waiter->banned_until);
+                waiter = NULL;
+            }
+        }
+        if (!waiter) {
+            req->next = NULL;
+            if (deferred_last)
+                deferred_last->next = req;
+            else
+                deferred = req;
+            deferred_last = req;
+            continue;
+        }
+
+        if (req->weight != 0 && fairlock_weight(req->weight) != waiter->weight)
+            set_waiter_weight(lock, waiter, fairlock_weight(req->weight));
+        waiter->start_ticks = now;
+        touch_waiter(lock, waiter);
+        lock->holder = waiter;
+        LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, (uintptr_t)req->fid, now - req->submitted);)
+        req->fn(req->arg);
+        fairlock_charge(lock, waiter, req->fiber, now_ns());
+        served++;
+        /* The submitter may return as soon as it sees done. */
+        atomic_store(&req->done, 1);
+    }
+
+    lock->combine_deferred = deferred;
+    lock->combine_deferred_last = deferred_last;
+}
+
+/*
+ * Run fn(arg) as a critical section of fid, possibly on another fiber that
+ * holds the lock at the time. Returns once it has run. A non-zero weight
+ * replaces the fiber's own, as for fair_lock_weighted().
+ */
+void fair_combine_weighted(struct fairlock *lock, int fid, unsigned int weight,
+                           void (*fn)(void *arg), void *arg)
+{
+    struct fairlock_request req;
+    unsigned int my_ticket;
+    uint64_t ban;
+    int spins = 0;
+
+    /* A combiner would only skip a section that is still banned. */
+    fairlock_wait_published_ban(lock, fid);
+
+    req.fn = fn;
+    req.arg = arg;
+    req.fid = fid;
+    req.weight = weight;
+    req.submitted = now_ns();
+    req.fiber = (uintptr_t)fiber_manager_get()->current_fiber;
+    atomic_init(&req.banned_until, 0);
+    atomic_init(&req.done, 0);
+    fairlock_push_requests(lock, &req, &req);
+
+    while (!atomic_load(&req.done)) {
+        ban = atomic_load(&req.banned_until);
+        if (ban > now_ns()) {
+            /* Skipped for a ban: sit it out before competing to combine. */
+            fairlock_wait_ban(ban);
+            continue;
+        }
+        if (fairlock_try_ticket(lock)) {
+            fairlock_combine_batch(lock);
+            fairlock_pass(lock);
+            continue;
+        }
+        if (++spins < FAIRLOCK_SPIN_LIMIT)
+            continue;
+        if (spins < FAIRLOCK_SPIN_LIMIT + FAIRLOCK_COMBINE_YIELDS) {
+            /* Let the combiner run; it may well take our section with it. */
+            fiber_yield();
+            continue;
+        }
+        /* The lock stays busy: queue for a ticket so our section cannot starve. */
+        spins = 0;
+        my_ticket = atomic_fetch_add(&lock->next_ticket, 1);
+        fairlock_wait_turn(lock, my_ticket);
+        fairlock_combine_batch(lock);
+        fairlock_pass(lock);
+    }
+}
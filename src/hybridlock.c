@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hybridlock.h"
+
+void hybridlock_init(struct hybridlock *lock)
+{
+    fiber_mutex_init(&lock->mutex);
+    atomic_init(&lock->mode, HYBRID_MUTEX);
+    lock->holder = NULL;
+    lock->start = 0;
+    lock->window_acquires = 0;
+    lock->window_contended = 0;
+    lock->window = 1;
+    lock->nthreads = 1;
+    memset(&lock->counters, 0, sizeof(lock->counters));
+
+    lock->fiber_bits = 0;
+    while ((1U << lock->fiber_bits) < HYBRIDLOCK_FIBER_SLOTS)
+        lock->fiber_bits++;
+    if (lock->fiber_bits < HASHMAP_MIN_BITS)
+        lock->fiber_bits = HASHMAP_MIN_BITS;
+    lock->fibers = calloc((size_t)1 << lock->fiber_bits, sizeof(*lock->fibers));
+    if (!lock->fibers) {
+        fprintf(stderr, "Error: Unable to allocate hybridlock fiber table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    LOCKSTAT_ONLY(lockstat_register(&lock->stats, "hybridlock", lock);)
+}
+
+/* Release the lock's resources. No fiber may be using or waiting for it. */
+void hybridlock_destroy(struct hybridlock *lock)
+{
+    LOCKSTAT_ONLY(lockstat_unregister(&lock->stats);)
+    free(lock->fibers);
+    lock->fibers = NULL;
+    fiber_mutex_destroy(&lock->mutex);
+}
+
+/* Counters up to the last completed window. */
+void hybridlock_get_stats(struct hybridlock *lock, struct hybridlock_stats *out)
+{
+    fiber_mutex_lock(&lock->mutex);
+    *out = lock->counters;
+    out->mode = atomic_load(&lock->mode);
+    fiber_mutex_unlock(&lock->mutex);
+}
+
+/*
+ * Review the window just completed and pick the mode for the next one.
+ * Fibers count as active if they had a timed section in this window or the
+ * one before, so a fiber sitting out a long ban is not dropped from nthreads.
+ * Caller holds the mutex.
+ */
+void hybridlock_end_window(struct hybridlock *lock)
+{
+    struct hybridlock_fiber *f;
+    uint64_t min_ewma = UINT64_MAX, max_ewma = 0;
+    unsigned int contended_pct, skew_pct = 0, active = 0;
+    size_t i;
+    int mode = atomic_load_explicit(&lock->mode, memory_order_relaxed);
+
+    for (i = 0; i < ((size_t)1 << lock->fiber_bits); i++) {
+        f = &lock->fibers[i];
+        if (atomic_load_explicit(&f->fiber, memory_order_relaxed) == 0 ||
+            f->window + 1 < lock->window || f->cs_ewma_ns == 0)
+            continue;
+        active++;
+        if (f->cs_ewma_ns < min_ewma)
+            min_ewma = f->cs_ewma_ns;
+        if (f->cs_ewma_ns > max_ewma)
+            max_ewma = f->cs_ewma_ns;
+    }
+    if (active > 1)
+        skew_pct = (unsigned int)(max_ewma * 100 / min_ewma);
+    contended_pct = lock->window_contended * 100 / lock->window_acquires;
+
+    if (mode == HYBRID_MUTEX &&
+        contended_pct >= HYBRIDLOCK_CONTENDED_ON_PCT && skew_pct >= HYBRIDLOCK_SKEW_ON_PCT) {
+        atomic_store_explicit(&lock->mode, HYBRID_FAIR, memory_order_relaxed);
+        lock->counters.to_fair++;
+    } else if (mode == HYBRID_FAIR &&
+               (contended_pct < HYBRIDLOCK_CONTENDED_OFF_PCT ||
+                skew_pct < HYBRIDLOCK_SKEW_OFF_PCT)) {
+        /* Bans left over are simply no longer checked. */
+        atomic_store_explicit(&lock->mode, HYBRID_MUTEX, memory_order_relaxed);
+        lock->counters.to_mutex++;
+    }
+
+    lock->counters.acquires += lock->window_acquires;
+    lock->counters.contended += lock->window_contended;
+    lock->nthreads = active > 0 ? active : 1;
+    lock->window_acquires = 0;
+    lock->window_contended = 0;
+    lock->window++;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include "timing.h"
+#include "lockcond.h"
+
+void lock_cond_init(struct lock_cond *cond)
+{
+    fiber_mutex_init(&cond->mutex);
+    cond->head = NULL;
+    cond->tail = NULL;
+    atomic_init(&cond->nwaiters, 0);
+    memset(&cond->stats, 0, sizeof(cond->stats));
+}
+
+/* Release the cond's resources. No fiber may be waiting on it. */
+void lock_cond_destroy(struct lock_cond *cond)
+{
+    fiber_mutex_destroy(&cond->mutex);
+}
+
+void lock_cond_get_stats(struct lock_cond *cond, struct lock_cond_stats *out)
+{
+    fiber_mutex_lock(&cond->mutex);
+    *out = cond->stats;
+    fiber_mutex_unlock(&cond->mutex);
+}
+
+/* File w at the tail. Called while the caller still holds its lock. */
+static void lock_cond_enqueue(struct lock_cond *cond, struct lock_cond_waiter *w)
+{
+    w->next = NULL;
+    w->woken = 0;
+    fiber_cond_init(&w->cond);
+
+    fiber_mutex_lock(&cond->mutex);
+    if (cond->tail)
+        cond->tail->next = w;
+    else
+        cond->head = w;
+    cond->tail = w;
+    atomic_fetch_add(&cond->nwaiters, 1);
+    cond->stats.waits++;
+    fiber_mutex_unlock(&cond->mutex);
+}
+
+/* Park until w is woken. Called after the caller has let go of its lock. */
+static void lock_cond_park(struct lock_cond *cond, struct lock_cond_waiter *w, uint64_t since)
+{
+    fiber_mutex_lock(&cond->mutex);
+    while (!w->woken) {
+        fiber_cond_wait(&w->cond, &cond->mutex);
+    }
+    cond->stats.wait_ns += now_ns() - since;
+    fiber_mutex_unlock(&cond->mutex);
+    fiber_cond_destroy(&w->cond);
+}
+
+/* Wake up to n of the oldest waiters. */
+void lock_cond_wake(struct lock_cond *cond, unsigned int n)
+{
+    struct lock_cond_waiter *w;
+
+    fiber_mutex_lock(&cond->mutex);
+    while (n-- > 0 && cond->head) {
+        w = cond->head;
+        cond->head = w->next;
+        if (!cond->head)
+            cond->tail = NULL;
+        atomic_fetch_sub(&cond->nwaiters, 1);
+        cond->stats.woken++;
+        w->woken = 1;
+        fiber_cond_signal(&w->cond);
+    }
+    fiber_mutex_unlock(&cond->mutex);
+}
+
+/*
+ * Wait on cond, holding a critical section of lock. Returns holding a new
+ * one, in a new slice.
+ */
+void sched_lock_cond_wait(struct sched_lock *lock, struct lock_cond *cond)
+{
+    struct lock_cond_waiter w;
+    struct sched_cs_mark mark;
+    uint64_t since;
+
+    lock_cond_enqueue(cond, &w);
+    since = now_ns();
+    sched_lock_release_slice(lock);
+    atomic_fetch_add(&lock->cond_waiters, 1);
+    /* Any other sched_lock held stays with the fiber, not this worker. */
+    mark = sched_cs_save();
+    lock_cond_park(cond, &w, since);
+    sched_cs_restore(mark);
+    atomic_fetch_sub(&lock->cond_waiters, 1);
+    sched_lock_acquire(lock);
+}
+
+/* Wait on cond, holding lock as fid. Returns holding it again as fid. */
+void fair_cond_wait(struct fairlock *lock, int fid, struct lock_cond *cond)
+{
+    struct lock_cond_waiter w;
+    uint64_t since;
+
+    lock_cond_enqueue(cond, &w);
+    since = now_ns();
+    fair_unlock_cond(lock);
+    lock_cond_park(cond, &w, since);
+    fair_lock(lock, fid);
+    fairlock_cond_return(lock);
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lockdomain.h"
+
+__thread int lock_domain_worker_id = -1;
+
+static atomic_int lock_domain_worker_used[LOCK_DOMAIN_MAX_WORKERS];
+static pthread_key_t lock_domain_worker_key;
+static pthread_once_t lock_domain_worker_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: hand the worker id (stored + 1) back for the next thread. */
+static void lock_domain_worker_exit(void *id)
+{
+    atomic_store_explicit(&lock_domain_worker_used[(intptr_t)id - 1], 0, memory_order_release);
+}
+
+static void lock_domain_worker_key_init(void)
+{
+    if (pthread_key_create(&lock_domain_worker_key, lock_domain_worker_exit) != 0) {
+        fprintf(stderr, "Error: Unable to allocate lock domain worker key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void lock_domain_init(struct lock_domain *domain)
+{
+    memset(domain->workers, 0, sizeof(domain->workers));
+    atomic_init(&domain->nfibers, 1);
+    atomic_init(&domain->recount_at, 0);
+
+    domain->fiber_bits = 0;
+    while ((1U << domain->fiber_bits) < LOCK_DOMAIN_FIBER_SLOTS)
+        domain->fiber_bits++;
+    if (domain->fiber_bits < HASHMAP_MIN_BITS)
+        domain->fiber_bits = HASHMAP_MIN_BITS;
+    domain->fibers = calloc((size_t)1 << domain->fiber_bits, sizeof(*domain->fibers));
+    if (!domain->fibers) {
+        fprintf(stderr, "Error: Unable to allocate lock domain fiber table\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Release the domain's resources. None of its locks may be in use. */
+void lock_domain_destroy(struct lock_domain *domain)
+{
+    free(domain->fibers);
+    domain->fibers = NULL;
+}
+
+/*
+ * Claim a free worker id. Each domain's counters for it stay with the id, so
+ * a new thread keeps adding to what the previous owner charged.
+ */
+struct lock_domain_worker *lock_domain_worker_slow(struct lock_domain *domain)
+{
+    int i, expected;
+
+    pthread_once(&lock_domain_worker_once, lock_domain_worker_key_init);
+    for (i = 0; i < LOCK_DOMAIN_MAX_WORKERS; i++) {
+        expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&lock_domain_worker_used[i], &expected, 1,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            pthread_setspecific(lock_domain_worker_key, (void *)(intptr_t)(i + 1));
+            lock_domain_worker_id = i;
+            return &domain->workers[i];
+        }
+    }
+    fprintf(stderr, "Error: More than %d threads charging lock domains "
+                    "(raise LOCK_DOMAIN_MAX_WORKERS)\n", LOCK_DOMAIN_MAX_WORKERS);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Count the fibers active within LOCK_DOMAIN_INACTIVE_NS of now. Whoever
+ * moves recount_at on does the count; everyone else keeps the old one.
+ */
+void lock_domain_recount(struct lock_domain *domain, uint64_t now)
+{
+    uint64_t due = atomic_load(&domain->recount_at);
+    uint64_t last;
+    unsigned int active = 0;
+    size_t i;
+
+    if (now < due ||
+        !atomic_compare_exchange_strong(&domain->recount_at, &due, now + LOCK_DOMAIN_RECOUNT_NS))
+        return;
+
+    for (i = 0; i < ((size_t)1 << domain->fiber_bits); i++) {
+        if (atomic_load_explicit(&domain->fibers[i].fiber, memory_order_relaxed) == 0)
+            continue;
+        last = atomic_load_explicit(&domain->fibers[i].last_ns, memory_order_relaxed);
+        if (last + LOCK_DOMAIN_INACTIVE_NS >= now)
+            active++;
+    }
+    atomic_store_explicit(&domain->nfibers, active > 0 ? active : 1, memory_order_relaxed);
+}
+
+/* Totals over all workers; may be slightly torn while the locks are in use. */
+void lock_domain_get_stats(struct lock_domain *domain, struct lock_domain_stats *out)
+{
+    uint64_t hold;
+    size_t i;
+
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < LOCK_DOMAIN_MAX_WORKERS; i++) {
+        out->hold_ns += domain->workers[i].hold_ns;
+        out->charges += domain->workers[i].charges;
+        out->ban_waits += domain->workers[i].ban_waits;
+    }
+    out->nfibers = atomic_load(&domain->nfibers);
+    for (i = 0; i < ((size_t)1 << domain->fiber_bits); i++) {
+        if (atomic_load(&domain->fibers[i].fiber) == 0)
+            continue;
+        hold = atomic_load(&domain->fibers[i].hold_ns);
+        if (hold > out->max_fiber_hold_ns)
+            out->max_fiber_hold_ns = hold;
+    }
+}
+
+/* Hold time charged to fiber across the domain, 0 if it has no record. */
+uint64_t lock_domain_fiber_hold(struct lock_domain *domain, uintptr_t fiber)
+{
+    size_t mask = ((size_t)1 << domain->fiber_bits) - 1;
+    size_t i = _hashmap_index(fiber, domain->fiber_bits);
+    int n;
+
+    for (n = 0; n < LOCK_DOMAIN_FIBER_PROBES; n++, i = (i + 1) & mask) {
+        if (atomic_load(&domain->fibers[i].fiber) == fiber)
+            return atomic_load(&domain->fibers[i].hold_ns);
+    }
+    return 0;
+}
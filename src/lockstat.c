@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <signal.h>
+#include "lockstat.h"
+
+#ifdef LOCKSTAT
+
+static struct lockstat *lockstat_registry;
+static pthread_mutex_t lockstat_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int lockstat_worker_used[LOCKSTAT_MAX_WORKERS];
+static pthread_key_t lockstat_worker_key;
+static pthread_once_t lockstat_worker_once = PTHREAD_ONCE_INIT;
+__thread int lockstat_worker_id = -1;
+
+/* Thread exit: hand the worker id (stored + 1) back for the next thread. */
+static void lockstat_worker_exit(void *id)
+{
+    atomic_store_explicit(&lockstat_worker_used[(intptr_t)id - 1], 0, memory_order_release);
+}
+
+static void lockstat_worker_key_init(void)
+{
+    if (pthread_key_create(&lockstat_worker_key, lockstat_worker_exit) != 0) {
+        fprintf(stderr, "Error: Unable to allocate lock statistics\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Claim a free worker id. The buffers behind it stay with the id, so a new
+ * thread keeps adding to what the previous owner recorded. */
+static int lockstat_worker_claim(void)
+{
+    int i, expected;
+
+    pthread_once(&lockstat_worker_once, lockstat_worker_key_init);
+    for (i = 0; i < LOCKSTAT_MAX_WORKERS; i++) {
+        expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&lockstat_worker_used[i], &expected, 1,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            pthread_setspecific(lockstat_worker_key, (void *)(intptr_t)(i + 1));
+            return i;
+        }
+    }
+    fprintf(stderr, "Error: More than %d threads recording lock statistics "
+                    "(raise LOCKSTAT_MAX_WORKERS)\n", LOCKSTAT_MAX_WORKERS);
+    exit(EXIT_FAILURE);
+}
+
+void lockstat_register(struct lockstat *ls, const char *name, const void *lock)
+{
+    int i;
+
+    ls->name = name;
+    ls->lock = lock;
+    for (i = 0; i < LOCKSTAT_MAX_WORKERS; i++) {
+        atomic_init(&ls->workers[i], NULL);
+    }
+
+    pthread_mutex_lock(&lockstat_registry_mutex);
+    ls->next = lockstat_registry;
+    lockstat_registry = ls;
+    pthread_mutex_unlock(&lockstat_registry_mutex);
+}
+
+void lockstat_unregister(struct lockstat *ls)
+{
+    struct lockstat **pos;
+    struct lockstat_worker *w;
+    int i;
+
+    pthread_mutex_lock(&lockstat_registry_mutex);
+    for (pos = &lockstat_registry; *pos; pos = &(*pos)->next) {
+        if (*pos == ls) {
+            *pos = ls->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lockstat_registry_mutex);
+
+    for (i = 0; i < LOCKSTAT_MAX_WORKERS; i++) {
+        w = atomic_load(&ls->workers[i]);
+        free(w);
+    }
+}
+
+struct lockstat_worker *lockstat_local_slow(struct lockstat *ls)
+{
+    struct lockstat_worker *w, *expected = NULL;
+
+    if (lockstat_worker_id < 0)
+        lockstat_worker_id = lockstat_worker_claim();
+
+    w = atomic_load_explicit(&ls->workers[lockstat_worker_id], memory_order_acquire);
+    if (w != NULL)
+        return w;
+
+    w = (struct lockstat_worker *)calloc(1, sizeof(*w));
+    if (!w) {
+        fprintf(stderr, "Error: Unable to allocate lock statistics\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!atomic_compare_exchange_strong(&ls->workers[lockstat_worker_id], &expected, w)) {
+        free(w);
+        w = expected;
+    }
+    return w;
+}
+
+static void lockstat_print_hist(FILE *out, const char *name, const struct histogram *h)
+{
+    fprintf(out, "\"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %llu, \"max\": %llu, "
+                 "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu}",
+            name,
+            (unsigned long long)h->count,
+            (unsigned long long)h->min,
+            (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)h->max,
+            (unsigned long long)histogram_percentile(h, 50.0),
+            (unsigned long long)histogram_percentile(h, 90.0),
+            (unsigned long long)histogram_percentile(h, 99.0),
+            (unsigned long long)histogram_percentile(h, 99.9));
+}
+
+static void lockstat_print_lock(FILE *out, struct lockstat *ls)
+{
+    struct lockstat_worker *total, *w;
+    struct lockstat_fiber *f;
+    struct hashmap fibers;           // fiber key -> acquires + 1, dump-local
+    struct hashmap_entry *e;
+    size_t i;
+    int first = 1;
+    int k;
+
+    total = (struct lockstat_worker *)calloc(1, sizeof(*total));
+    if (!total || hashmap_init(&fibers, 6) != 0) {
+        fprintf(stderr, "Error: Unable to allocate lock statistics\n");
+        free(total);
+        return;
+    }
+
+    for (k = 0; k < LOCKSTAT_MAX_WORKERS; k++) {
+        w = atomic_load(&ls->workers[k]);
+        if (!w)
+            continue;
+        total->acquires += w->acquires;
+        total->handoffs += w->handoffs;
+        total->slice_expirations += w->slice_expirations;
+        total->ban_requeues += w->ban_requeues;
+        total->other_acquires += w->other_acquires;
+        histogram_merge(&total->wait, &w->wait);
+        histogram_merge(&total->hold, &w->hold);
+        histogram_merge(&total->ban, &w->ban);
+        for (i = 0; i < LOCKSTAT_FIBER_SLOTS; i++) {
+            f = &w->fibers[i];
+            if (f->acquires) {
+                uintptr_t n = (uintptr_t)hashmap_get(&fibers, f->key);
+                hashmap_put(&fibers, f->key, (void *)((n ? n : 1) + f->acquires));
+            }
+        }
+    }
+
+    fprintf(out, "{\"name\": \"%s\", \"lock\": \"%p\", \"acquires\": %llu, "
+                 "\"handoffs\": %llu, \"slice_expirations\": %llu, \"ban_requeues\": %llu, ",
+            ls->name, ls->lock,
+            (unsigned long long)total->acquires,
+            (unsigned long long)total->handoffs,
+            (unsigned long long)total->slice_expirations,
+            (unsigned long long)total->ban_requeues);
+    lockstat_print_hist(out, "wait_ns", &total->wait);
+    fprintf(out, ", ");
+    lockstat_print_hist(out, "hold_ns", &total->hold);
+    fprintf(out, ", ");
+    lockstat_print_hist(out, "ban_ns", &total->ban);
+    fprintf(out, ", \"fibers\": [");
+    for (i = 0; i < ((size_t)1 << fibers.bits); i++) {
+        e = &fibers.slots[i];
+        if (e->value) {
+            fprintf(out, "%s{\"fiber\": %llu, \"acquires\": %llu}", first ? "" : ", ",
+                    (unsigned long long)e->key, (unsigned long long)((uintptr_t)e->value - 1));
+            first = 0;
+        }
+    }
+    fprintf(out, "], \"other_fiber_acquires\": %llu}", (unsigned long long)total->other_acquires);
+
+    hashmap_destroy(&fibers);
+    free(total);
+}
+
+void lockstat_dump_json(FILE *out)
+{
+    struct lockstat *ls;
+
+    pthread_mutex_lock(&lockstat_registry_mutex);
+    fprintf(out, "{\"locks\": [");
+    for (ls = lockstat_registry; ls; ls = ls->next) {
+        lockstat_print_lock(out, ls);
+        if (ls->next)
+            fprintf(out, ", ");
+    }
+    fprintf(out, "]}\n");
+    pthread_mutex_unlock(&lockstat_registry_mutex);
+    fflush(out);
+}
+
+/* Dump to $LOCKSTAT_FILE (appending) or stderr. */
+void lockstat_dump(void)
+{
+    const char *path = getenv("LOCKSTAT_FILE");
+    FILE *out = path ? fopen(path, "a") : stderr;
+
+    if (!out) {
+        fprintf(stderr, "Error: Unable to open %s\n", path);
+        return;
+    }
+    lockstat_dump_json(out);
+    if (out != stderr)
+        fclose(out);
+}
+
+static void *lockstat_signal_thread(void *param)
+{
+    sigset_t *set = (sigset_t *)param;
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig) == 0 && sig == SIGUSR1)
+            lockstat_dump();
+    }
+    return NULL;
+}
+
+/* Dump on SIGUSR1 from a helper thread, so dumping never runs in a signal handler. */
+void lockstat_init(void)
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&thread, NULL, lockstat_signal_thread, &set) == 0)
+        pthread_detach(thread);
+}
+
+#endif /* LOCKSTAT */
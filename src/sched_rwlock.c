@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "sched_rwlock.h"
+
+void sched_rwlock_init(struct sched_rwlock *lock)
+{
+    atomic_init(&lock->phase, SCHED_RW_READ);
+    atomic_init(&lock->phase_end, 0);
+    atomic_init(&lock->readers, 0);
+    atomic_init(&lock->writer, 0);
+    atomic_init(&lock->waiting_readers, 0);
+    atomic_init(&lock->waiting_writers, 0);
+    atomic_flag_clear(&lock->guard);
+    lock->slice_ns = SLICE_SIZE_US * NSEC_PER_USEC;
+
+    lock->fiber_bits = 0;
+    while ((1U << lock->fiber_bits) < SCHED_LOCK_FIBER_SLOTS)
+        lock->fiber_bits++;
+    if (lock->fiber_bits < HASHMAP_MIN_BITS)
+        lock->fiber_bits = HASHMAP_MIN_BITS;
+    lock->fibers = calloc((size_t)1 << lock->fiber_bits, sizeof(*lock->fibers));
+    if (!lock->fibers) {
+        fprintf(stderr, "Error: Unable to allocate sched_rwlock fiber table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    LOCKSTAT_ONLY(lockstat_register(&lock->stats, "sched_rwlock", lock);)
+}
+
+/* No fiber may be using or waiting for the lock. */
+void sched_rwlock_destroy(struct sched_rwlock *lock)
+{
+    LOCKSTAT_ONLY(lockstat_unregister(&lock->stats);)
+    free(lock->fibers);
+    lock->fibers = NULL;
+}
+
+/* The calling fiber's slot in the lock's fiber table, claimed on first use. NULL if none is free. */
+static struct sched_lock_fiber *sched_rw_fiber(struct sched_rwlock *lock, uintptr_t self)
+{
+    size_t mask = ((size_t)1 << lock->fiber_bits) - 1;
+    size_t i = _hashmap_index(self, lock->fiber_bits);
+    uintptr_t key;
+    int n;
+
+    for (n = 0; n < SCHED_LOCK_FIBER_PROBES; n++, i = (i + 1) & mask) {
+        key = atomic_load_explicit(&lock->fibers[i].fiber, memory_order_acquire);
+        if (key == self)
+            return &lock->fibers[i];
+        if (key == 0 && atomic_compare_exchange_strong(&lock->fibers[i].fiber, &key, self))
+            return &lock->fibers[i];
+    }
+    return NULL;
+}
+
+static void sched_rw_guard_lock(struct sched_rwlock *lock)
+{
+    while (atomic_flag_test_and_set(&lock->guard)) {
+    }
+}
+
+static void sched_rw_guard_unlock(struct sched_rwlock *lock)
+{
+    atomic_flag_clear(&lock->guard);
+}
+
+/* Start a new slice for the other side. Caller holds the guard. */
+static void sched_rw_switch(struct sched_rwlock *lock, int to, uint64_t now)
+{
+    LOCKSTAT_ONLY(lockstat_slice_expired(&lock->stats);)
+    atomic_store(&lock->phase_end, now + lock->slice_ns);
+    atomic_store(&lock->phase, to);
+}
+
+/* Find the calling fiber's slot and wait out its ban on this lock, if any. */
+static void sched_rw_wait_ban(struct sched_rwlock *lock, struct sched_rw_hold *hold, uintptr_t self)
+{
+    struct sched_lock_fiber *me = sched_rw_fiber(lock, self);
+
+    hold->me = me;
+    if (!me)
+        return;
+    // Colour if UnColoured and Record Lock.
+    if (!me->coloured) {
+        set_fiber_colour((void*)lock, lock->slice_ns / NSEC_PER_USEC);
+        me->coloured = 1;
+    }
+    sched_lock_wait_ban(me->banned_until);
+}
+
+/* Charge the calling fiber for one critical section. */
+static void sched_rw_charge(struct sched_rwlock *lock, struct sched_rw_hold *hold)
+{
+    struct sched_lock_fiber *me = hold->me;
+    uint64_t end = now_ns();
+    uint64_t cs_length = end - hold->start;
+    uint64_t start = hold->start;
+    /* The ban timer fiber never competes for the lock. */
+    int nthreads = get_fiber_count() - ban_queue_fibers();
+
+    LOCKSTAT_ONLY(lockstat_released(&lock->stats, cs_length);)
+    if (!me || nthreads <= 1)
+        return;
+
+    if (me->banned_until < start)
+        me->banned_until = start;
+    me->banned_until += cs_length * nthreads;
+    LOCKSTAT_ONLY(lockstat_banned(&lock->stats, me->banned_until - end);)
+}
+
+void sched_read_acquire(struct sched_rwlock *lock, struct sched_rw_hold *hold)
+{
+    uintptr_t self = (uintptr_t)fiber_manager_get()->current_fiber;
+    uint64_t now;
+    int spins = 0;
+    LOCKSTAT_ONLY(uint64_t wait_start = now_ns();)
+
+    sched_rw_wait_ban(lock, hold, self);
+
+    atomic_fetch_add(&lock->waiting_readers, 1);
+    for (;;) {
+        now = now_ns();
+        if (atomic_load(&lock->phase) == SCHED_RW_READ) {
+            if (now < atomic_load(&lock->phase_end) ||
+                atomic_load(&lock->waiting_writers) == 0) {
+                atomic_fetch_add(&lock->readers, 1);
+                if (atomic_load(&lock->phase) == SCHED_RW_READ)
+                    break;
+                /* A writer switched the phase under us. */
+                atomic_fetch_sub(&lock->readers, 1);
+            } else {
+                /* Read slice used up and writers waiting => their turn. */
+                sched_rw_guard_lock(lock);
+                if (atomic_load(&lock->phase) == SCHED_RW_READ)
+                    sched_rw_switch(lock, SCHED_RW_WRITE, now);
+                sched_rw_guard_unlock(lock);
+            }
+        } else if (atomic_load(&lock->writer) == 0 &&
+                   (now >= atomic_load(&lock->phase_end) ||
+                    atomic_load(&lock->waiting_writers) == 0)) {
+            sched_rw_guard_lock(lock);
+            if (atomic_load(&lock->phase) == SCHED_RW_WRITE && atomic_load(&lock->writer) == 0)
+                sched_rw_switch(lock, SCHED_RW_READ, now);
+            sched_rw_guard_unlock(lock);
+            continue;
+        }
+        if (++spins >= SCHED_LOCK_SPIN_LIMIT)
+            sched_lock_yield();
+    }
+    atomic_fetch_sub(&lock->waiting_readers, 1);
+
+    hold->start = now_ns();
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, self, hold->start - wait_start);)
+}
+
+void sched_read_release(struct sched_rwlock *lock, struct sched_rw_hold *hold)
+{
+    sched_rw_charge(lock, hold);
+    atomic_fetch_sub(&lock->readers, 1);
+    ban_queue_poll();
+}
+
+void sched_write_acquire(struct sched_rwlock *lock, struct sched_rw_hold *hold)
+{
+    uintptr_t self = (uintptr_t)fiber_manager_get()->current_fiber;
+    uint64_t now;
+    int claimed = 0;
+    int spins = 0;
+    LOCKSTAT_ONLY(uint64_t wait_start = now_ns();)
+
+    sched_rw_wait_ban(lock, hold, self);
+
+    atomic_fetch_add(&lock->waiting_writers, 1);
+    while (!claimed) {
+        now = now_ns();
+        sched_rw_guard_lock(lock);
+        if (atomic_load(&lock->phase) == SCHED_RW_WRITE) {
+            if (atomic_load(&lock->writer) == 0 &&
+                (now < atomic_load(&lock->phase_end) ||
+                 atomic_load(&lock->waiting_readers) == 0)) {
+                atomic_store(&lock->writer, self);
+                claimed = 1;
+            }
+        } else if (now >= atomic_load(&lock->phase_end) ||
+                   (atomic_load(&lock->waiting_readers) == 0 &&
+                    atomic_load(&lock->readers) == 0)) {
+            /* Read slice used up (or idle) => start a write slice. */
+            sched_rw_switch(lock, SCHED_RW_WRITE, now);
+            sched_rw_guard_unlock(lock);
+            continue;
+        }
+        sched_rw_guard_unlock(lock);
+        if (!claimed && ++spins >= SCHED_LOCK_SPIN_LIMIT)
+            sched_lock_yield();
+    }
+    atomic_fetch_sub(&lock->waiting_writers, 1);
+
+    /* Readers from the previous read slice drain; new ones see the write phase. */
+    while (atomic_load(&lock->readers) != 0) {
+        if (++spins >= SCHED_LOCK_SPIN_LIMIT)
+            sched_lock_yield();
+    }
+
+    hold->start = now_ns();
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, self, hold->start - wait_start);)
+}
+
+void sched_write_release(struct sched_rwlock *lock, struct sched_rw_hold *hold)
+{
+    sched_rw_charge(lock, hold);
+    atomic_store(&lock->writer, 0);
+    ban_queue_poll();
+}
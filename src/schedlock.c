@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "schedlock.h"
+
+__thread struct sched_cs_mark sched_cs_mark;
+static _Atomic uint64_t sched_preempt_deferred;
+static _Atomic uint64_t sched_preempt_expired;
+_Atomic uint64_t sched_preempt_forced_yields;
+static _Atomic uint64_t sched_preempt_switched_in_cs;
+
+void sched_lock_init(struct sched_lock *lock)
+{
+    struct sched_lock_config config = SCHED_LOCK_CONFIG_DEFAULT;
+
+    sched_lock_init_config(lock, &config);
+}
+
+void sched_lock_init_config(struct sched_lock *lock, const struct sched_lock_config *config)
+{
+    int i;
+
+    // fiber_mutex_init(&lock->spinlock);
+    atomic_init(&lock->owner, 0);
+    lock->start_ticks = 0;
+    lock->end_ticks = 0;
+    atomic_init(&lock->slice_end_time, 0);
+    lock->slice_set = 0; // can be used to track is lock is held 
+
+    lock->cohort_level = SCHED_COHORT_NONE;
+    lock->cohort_budget = 0;
+    lock->cohort_slices = 0;
+    lock->owner_cohort = 0;
+    atomic_init(&lock->cohort_id, -1);
+    for (i = 0; i < SCHED_LOCK_MAX_COHORTS; i++) {
+        atomic_init(&lock->waiting[i], 0);
+    }
+
+    lock->config = *config;
+    if (lock->config.min_slice_ns > lock->config.max_slice_ns)
+        lock->config.min_slice_ns = lock->config.max_slice_ns;
+    lock->slice_ns = SLICE_SIZE_US * NSEC_PER_USEC;
+    lock->cs_start = 0;
+    lock->slice_cs_ns = 0;
+    memset(&lock->slice_stats, 0, sizeof(lock->slice_stats));
+    lock->slice_stats.slice_ns = lock->slice_ns;
+    lock->slice_stats.min_slice_ns = lock->slice_ns;
+    lock->slice_stats.max_slice_ns = lock->slice_ns;
+
+    lock->fiber_bits = 0;
+    while ((1U << lock->fiber_bits) < config->fiber_slots)
+        lock->fiber_bits++;
+    if (lock->fiber_bits < HASHMAP_MIN_BITS)
+        lock->fiber_bits = HASHMAP_MIN_BITS;
+    lock->fibers = calloc((size_t)1 << lock->fiber_bits, sizeof(*lock->fibers));
+    if (!lock->fibers) {
+        fprintf(stderr, "Error: Unable to allocate sched_lock fiber table\n");
+        exit(EXIT_FAILURE);
+    }
+    lock->owner_fiber = NULL;
+    lock->domain = NULL;
+    atomic_init(&lock->cond_waiters, 0);
+
+    LOCKSTAT_ONLY(lockstat_register(&lock->stats, "sched_lock", lock);)
+}
+
+/* Release the lock's resources. No fiber may be using or waiting for it. */
+void sched_lock_destroy(struct sched_lock *lock)
+{
+    LOCKSTAT_ONLY(lockstat_unregister(&lock->stats);)
+    free(lock->fibers);
+    lock->fibers = NULL;
+}
+
+/* Process-wide preemption-avoidance counters, see SCHED_LOCK_PREEMPT_DEFER_NS. */
+void sched_lock_get_preempt_stats(struct sched_lock_preempt_stats *out)
+{
+    out->deferred = atomic_load(&sched_preempt_deferred);
+    out->expired = atomic_load(&sched_preempt_expired);
+    out->forced_yields = atomic_load(&sched_preempt_forced_yields);
+    out->switched_in_cs = atomic_load(&sched_preempt_switched_in_cs);
+}
+
+/*
+ * Scheduler hook: may the running fiber be switched out now? Returns 1 if the
+ * switch should be put off because the fiber is inside a sched_lock critical
+ * section that has not yet run for SCHED_LOCK_PREEMPT_DEFER_NS.
+ */
+int sched_lock_preempt_check(void)
+{
+    struct sched_cs_mark *mark = &sched_cs_mark;
+
+    if (!sched_cs_held((uintptr_t)fiber_manager_get()->current_fiber))
+        return 0;
+    if (now_ns() - mark->since >= SCHED_LOCK_PREEMPT_DEFER_NS) {
+        atomic_fetch_add_explicit(&sched_preempt_expired, 1, memory_order_relaxed);
+        return 0;
+    }
+    mark->yield_pending = 1;
+    atomic_fetch_add_explicit(&sched_preempt_deferred, 1, memory_order_relaxed);
+    return 1;
+}
+
+/* Take the running fiber's mark off this worker before it switches out. */
+struct sched_cs_mark sched_cs_save(void)
+{
+    struct sched_cs_mark mark = sched_cs_mark;
+
+    /* A mark left here by another fiber stays for that fiber to ignore. */
+    if (!sched_cs_held((uintptr_t)fiber_manager_get()->current_fiber))
+        return (struct sched_cs_mark){ 0 };
+    atomic_fetch_add_explicit(&sched_preempt_switched_in_cs, 1, memory_order_relaxed);
+    sched_cs_mark = (struct sched_cs_mark){ 0 };
+    return mark;
+}
+
+/* Put the mark back on whichever worker the fiber resumed on. */
+void sched_cs_restore(struct sched_cs_mark mark)
+{
+    sched_cs_mark = mark;
+}
+
+/* fiber_yield() for lock code that may run inside a critical section. */
+void sched_lock_yield(void)
+{
+    struct sched_cs_mark mark = sched_cs_save();
+
+    fiber_yield();
+    sched_cs_restore(mark);
+}
+
+/* Copy out the slice-length counters. Racy while the lock is in use, which is fine for monitoring. */
+void sched_lock_get_slice_stats(struct sched_lock *lock, struct sched_lock_slice_stats *out)
+{
+    *out = lock->slice_stats;
+}
+
+/* Choose the length of the next slice. Called by the owner at slice expiry. */
+static void sched_lock_adapt_slice(struct sched_lock *lock, uint64_t now)
+{
+    struct sched_lock_slice_stats *st = &lock->slice_stats;
+    unsigned int waiters = 0;
+    uint64_t slice;
+    int i;
+
+    for (i = 0; i < SCHED_LOCK_MAX_COHORTS; i++) {
+        waiters += atomic_load(&lock->waiting[i]);
+    }
+    st->waiters_x16 += ((int)(waiters << 4) - (int)st->waiters_x16) / (1 << lock->config.ewma_shift);
+
+    if (st->waiters_x16 < 16)
+        slice = lock->config.max_slice_ns;
+    else
+        slice = st->cs_ewma_ns * lock->config.cs_per_slice;
+    if (slice < lock->config.min_slice_ns)
+        slice = lock->config.min_slice_ns;
+    if (slice > lock->config.max_slice_ns)
+        slice = lock->config.max_slice_ns;
+
+    if (slice != lock->slice_ns)
+        st->adjustments++;
+    lock->slice_ns = slice;
+    st->slice_ns = slice;
+    if (slice < st->min_slice_ns)
+        st->min_slice_ns = slice;
+    if (slice > st->max_slice_ns)
+        st->max_slice_ns = slice;
+    st->history[st->slices % SCHED_LOCK_SLICE_HISTORY] =
+        (struct sched_lock_slice_sample){ .when = now, .slice_ns = slice };
+}
+
+/*
+ * Batch up to budget consecutive slices within a CPU or NUMA-node cohort.
+ * Call before the lock is shared; SCHED_COHORT_NONE turns batching off.
+ */
+void sched_lock_set_cohort(struct sched_lock *lock, int level, unsigned int budget)
+{
+    lock->cohort_level = level;
+    lock->cohort_budget = budget;
+}
+
+/*
+ * Charge each slice's critical sections to domain as well, and make fibers sit out their domain
+ * ban before taking a slice. Call before the lock is shared.
+ */
+void sched_lock_set_domain(struct sched_lock *lock, struct lock_domain *domain)
+{
+    lock->domain = domain;
+}
+
+/* Cohort of the CPU the calling fiber is running on. */
+static int sched_lock_cohort(struct sched_lock *lock)
+{
+    unsigned int cpu = 0, node = 0;
+
+    if (lock->cohort_level == SCHED_COHORT_NONE)
+        return 0;
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    if (lock->cohort_level == SCHED_COHORT_CPU)
+        return cpu % SCHED_LOCK_MAX_COHORTS;
+    return node % SCHED_LOCK_MAX_COHORTS;
+}
+
+/* May a fiber from this cohort take the free slice? */
+static int sched_lock_admit(struct sched_lock *lock, int cohort)
+{
+    int reserved = atomic_load(&lock->cohort_id);
+
+    return reserved < 0 || reserved == cohort ||
+           atomic_load(&lock->waiting[reserved]) == 0;
+}
+
+/* Pick who may take the next slice, then free it. Called by the slice owner. */
+static void sched_lock_pass(struct sched_lock *lock)
+{
+    int cohort = lock->owner_cohort;
+    int i, next = -1;
+
+    LOCKSTAT_ONLY(for (i = 0; i < SCHED_LOCK_MAX_COHORTS; i++) {
+                      if (atomic_load(&lock->waiting[i]) > 0) {
+                          lockstat_handoff(&lock->stats);
+                          break;
+                      }
+                  })
+
+    if (lock->cohort_level != SCHED_COHORT_NONE) {
+        if (atomic_load(&lock->waiting[cohort]) > 0 &&
+            lock->cohort_slices + 1 < lock->cohort_budget) {
+            /* Keep the data on this node for another slice. */
+            lock->cohort_slices++;
+            next = cohort;
+        } else {
+            /* Budget used up: hand over to the next cohort with waiters. */
+            lock->cohort_slices = 0;
+            for (i = 1; i < SCHED_LOCK_MAX_COHORTS; i++) {
+                int c = (cohort + i) % SCHED_LOCK_MAX_COHORTS;
+                if (atomic_load(&lock->waiting[c]) > 0) {
+                    next = c;
+                    break;
+                }
+            }
+        }
+    }
+    atomic_store(&lock->cohort_id, next);
+    atomic_store(&lock->owner, 0);
+    ban_queue_poll();
+}
+
+/* Sit out a ban parked in the ban queue, off the run queue. */
+void sched_lock_wait_ban(uint64_t banned_until)
+{
+    struct sched_cs_mark mark;
+
+    if (now_ns() >= banned_until)
+        return;
+    mark = sched_cs_save();
+    ban_queue_wait(banned_until);
+    sched_cs_restore(mark);
+}
+
+/* Time left on the current fiber's ban for this lock. me is its slot, if it has one. */
+static uint64_t sched_lock_ban_remaining(struct sched_lock *lock, struct sched_lock_fiber *me)
+{
+    lock_stats_t stat;
+    uint64_t now;
+
+    if (!me) {
+        if (get_lock_fiber_data((void*)lock, &stat) == 0){
+            printf("Error: No Stats, something is wrong.\n");
+            abort();
+        }
+        return sched_ban_remaining(&stat);
+    }
+    now = now_ns();
+    return me->banned_until > now ? me->banned_until - now : 0;
+}
+
+/*
+ * Ban the owner of the slice ending at lock->end_ticks, fiber key owner with
+ * slot (NULL if it has none), and charge its domain. Returns the ban's end.
+ */
+static uint64_t sched_lock_ban_owner(struct sched_lock *lock, uintptr_t owner,
+                                     struct sched_lock_fiber *slot)
+{
+    /* Fibers parked on a lock_cond, and the ban timer, are not competing for the slice. */
+    int nthreads = get_fiber_count() - atomic_load(&lock->cond_waiters) - ban_queue_fibers();
+    uint64_t cs_length;
+    uint64_t banned_until = lock->end_ticks;
+
+    if (nthreads > 1) {
+        /* Expand ban time by (cs_length * num_threads). */
+        cs_length = lock->end_ticks - lock->start_ticks;
+        banned_until += cs_length * (nthreads - 1);
+        LOCKSTAT_ONLY(lockstat_banned(&lock->stats, cs_length * (nthreads - 1));)
+    }
+    /*
+     * The domain is charged for the critical sections run in the slice, not
+     * the slice: a fiber can own slices of several shards at once.
+     */
+    if (lock->domain)
+        lock_domain_charge(lock->domain, owner, lock->slice_cs_ns, lock->end_ticks);
+    /* If only one fiber, no ban needed. */
+    if (slot)
+        slot->banned_until = banned_until;
+    return banned_until;
+}
+
+/*
+ * Close the books on an expired slice taken over from its idle owner, as
+ * sched_lock_end_slice() would have at the owner's last release
+ * (lock->end_ticks). The owner is banned through its slot and charged to
+ * the domain; an owner without a slot keeps only its libfiber ban, which
+ * another fiber cannot set.
+ */
+static void sched_lock_steal_slice(struct sched_lock *lock, uintptr_t owner)
+{
+    LOCKSTAT_ONLY(lockstat_slice_expired(&lock->stats);)
+    if (lock->config.adaptive)
+        sched_lock_adapt_slice(lock, lock->end_ticks);
+    lock->slice_set = 0;
+    if (lock->owner_fiber)
+        lock->owner_fiber->coloured = 0;
+    sched_lock_ban_owner(lock, owner, lock->owner_fiber);
+}
+
+/* Claim the slice if it is free, or expired and idle. */
+static int sched_lock_try_take(struct sched_lock *lock, uintptr_t self, int cohort)
+{
+    uintptr_t owner = atomic_load(&lock->owner);
+
+    if (!sched_lock_admit(lock, cohort))
+        return 0;
+    if (owner != 0 &&
+        ((owner & SCHED_LOCK_HELD) || now_ns() <= atomic_load(&lock->slice_end_time)))
+        return 0;
+    if (!atomic_compare_exchange_strong(&lock->owner, &owner, self | SCHED_LOCK_HELD))
+        return 0;
+    if (owner != 0)
+        sched_lock_steal_slice(lock, owner);
+    return 1;
+}
+
+/*
+ * Wait for the slice to be free (and our cohort admitted), then own it.
+ *
+ * Only the fiber itself extends its ban, so the ban is checked once, up
+ * front, together with its domain ban (the later of the two counts): if it
+ * runs past deadline we give up at once with SCHED_LOCK_BANNED,
+ * otherwise it is waited out first. If the slice is still not ours by
+ * deadline, the result is SCHED_LOCK_BUSY when the caller did not want to
+ * wait at all, SCHED_LOCK_TIMEDOUT otherwise.
+ */
+static int sched_lock_take_until(struct sched_lock *lock, uintptr_t self,
+                                 struct sched_lock_fiber *me, uint64_t deadline)
+{
+    uint64_t start = now_ns();
+    uint64_t ban, domain_ban;
+    int cohort = sched_lock_cohort(lock);
+    int spins = 0;
+
+    ban = sched_lock_ban_remaining(lock, me);
+    if (lock->domain) {
+        domain_ban = lock_domain_ban(lock->domain, self);
+        if (domain_ban > start && domain_ban - start > ban)
+            ban = domain_ban - start;
+    }
+    if (ban > 0) {
+        if (deadline < start || deadline - start < ban)
+            return SCHED_LOCK_BANNED;
+        sched_lock_wait_ban(start + ban);
+    }
+
+    atomic_fetch_add(&lock->waiting[cohort], 1);
+    while (!sched_lock_try_take(lock, self, cohort)) {
+        if (now_ns() >= deadline) {
+            atomic_fetch_sub(&lock->waiting[cohort], 1);
+            return deadline > start ? SCHED_LOCK_TIMEDOUT : SCHED_LOCK_BUSY;
+        }
+        if (++spins >= SCHED_LOCK_SPIN_LIMIT)
+            sched_lock_yield();
+    }
+    atomic_fetch_sub(&lock->waiting[cohort], 1);
+    lock->owner_cohort = cohort;
+    return SCHED_LOCK_OK;
+}
+
+/* Everything sched_lock_acquire_until() does past the re-entry CAS. */
+int sched_lock_acquire_slow(struct sched_lock *lock, uintptr_t self,
+                            struct sched_lock_fiber *me, uint64_t deadline)
+{
+    int status;
+    LOCKSTAT_ONLY(uint64_t wait_start = now_ns();)
+
+    status = sched_lock_take_until(lock, self, me, deadline);
+    if (status != SCHED_LOCK_OK)
+        return status;
+    lock->owner_fiber = me;
+
+    // Record the start time.
+    lock->start_ticks = now_ns();
+    lock->cs_start = lock->start_ticks;
+    lock->slice_cs_ns = 0;
+
+    // Compute the slice end time.
+    atomic_store(&lock->slice_end_time, lock->start_ticks + lock->slice_ns);
+    lock->slice_set = 1;
+    lock->slice_stats.slices++;
+    sched_cs_enter(self);
+    LOCKSTAT_ONLY(lockstat_acquired(&lock->stats, self, lock->start_ticks - wait_start);)
+    return SCHED_LOCK_OK;
+}
+
+/* End the slice at lock->end_ticks: ban its owner and pass the lock. */
+static void sched_lock_end_slice(struct sched_lock *lock)
+{
+    if (lock->config.adaptive)
+        sched_lock_adapt_slice(lock, lock->end_ticks);
+    lock->slice_set = 0;
+    unset_colour(lock);
+    if (lock->owner_fiber)
+        lock->owner_fiber->coloured = 0;
+    ban_fibers(lock);
+    sched_lock_pass(lock);
+}
+
+/* The slice ran out during the critical section just released: ban its owner and pass the lock. */
+void sched_lock_expire(struct sched_lock *lock)
+{
+    LOCKSTAT_ONLY(lockstat_slice_expired(&lock->stats);)
+    sched_lock_end_slice(lock);
+    sched_lock_yield(); // Yield to Allow Others to get resources
+}
+
+/*
+ * Leave the critical section and give up the rest of the slice, for a fiber
+ * about to block (lock_cond waits). The owner is banned for the slice up to
+ * now, as if it had expired, and the lock passes on at once instead of
+ * sitting idle until the slice runs out. The fiber blocks next, which takes
+ * any preemption put off during the critical section.
+ */
+void sched_lock_release_slice(struct sched_lock *lock)
+{
+    sched_lock_leave_cs(lock);
+    sched_lock_end_slice(lock);
+}
+
+void ban_fibers(struct sched_lock *lock){
+    struct timeval slice_size = ns_to_timeval(lock->slice_ns);
+    uint64_t banned_until = sched_lock_ban_owner(lock, (uintptr_t)fiber_manager_get()->current_fiber,
+                                                 lock->owner_fiber);
+
+    /* libfiber keeps banned_until in gettimeofday() time; the scheduler reads it there. */
+    set_lock_fiber_data((void*)lock, ns_deadline_to_timeval(banned_until), slice_size, NULL);
+}
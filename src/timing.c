@@ -0,0 +1,29 @@
+#include "timing.h"
+
+#ifdef TIMING_SIMULATED
+uint64_t timing_sim_ns = 0;
+#endif
+
+#ifdef TIMING_USE_TSC
+
+#ifdef CYCLE_PER_US
+uint64_t tsc_ns_mult = (1000ULL << 32) / CYCLE_PER_US;
+#else
+uint64_t tsc_ns_mult = 0; // calibrated on first use
+#endif
+
+void timing_calibrate(void)
+{
+    uint64_t ns0, ns1, tsc0, tsc1;
+
+    ns0  = clock_raw_ns();
+    tsc0 = rdtsc();
+    do {
+        ns1 = clock_raw_ns();
+    } while (ns1 - ns0 < TIMING_CALIBRATE_NS);
+    tsc1 = rdtsc();
+
+    tsc_ns_mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+}
+
+#endif /* TIMING_USE_TSC */